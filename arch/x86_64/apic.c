@@ -136,10 +136,11 @@ void ic_enable() {
   apic_msr |= (1 << 11);          // Enable the APIC
   asm_wrmsr(IA32_APIC, apic_msr);
 
-  // NOTE: We no longer map the APIC into memory, since
-  // we assume the host loader/firmware has done so already
-  if (!use_x2apic) {
+  // Map the APIC's registers as uncached (only once, since every CPU has
+  // them at the same address)
+  if (!use_x2apic && xapic_base == 0) {
     xapic_base = asm_rdmsr(IA32_APIC) & 0xfffff000;
+    vm_map_mmio(xapic_base, 0x1000, VM_CACHE_UNCACHED);
   }
 
   // Enable the APIC (software level) and interrupts
@@ -180,7 +181,7 @@ void ic_timer_oneshot(uint64_t ms, uint16_t vec) {
     xapic_write(LAPIC_TIMER_LVT, (1 << 16));
 
     // Calculate the deadline for the TSC and setup the lapic regs
-    uint64_t goal = ms * this_cpu->tsc_freq;
+    uint64_t goal = ms * this_cpu_read(tsc_freq);
     xapic_write(LAPIC_TIMER_LVT, (vec | (0b10 << 17)) & ~(1 << 16));
 
     // Write the final goal, and off we go!
@@ -195,7 +196,7 @@ void ic_timer_oneshot(uint64_t ms, uint16_t vec) {
     xapic_write(LAPIC_TIMER_LVT,
                 (xapic_read(LAPIC_TIMER_LVT) & 0xFFFFFF00) | vec);
     xapic_write(LAPIC_TIMER_DIV, 0x3);
-    xapic_write(LAPIC_TIMER_INIT, this_cpu->lapic_freq * ms);
+    xapic_write(LAPIC_TIMER_INIT, this_cpu_read(lapic_freq) * ms);
 
     // Clear the mask, and off we go!
     xapic_write(LAPIC_TIMER_LVT, xapic_read(LAPIC_TIMER_LVT) & ~(1 << 16));
@@ -315,6 +316,7 @@ void scan_madt() {
         break;
       case 1: {  // I/O APIC
         madt_ioapic_t* ap = (madt_ioapic_t*)madt_ptr;
+        vm_map_mmio(ap->addr, 0x1000, VM_CACHE_UNCACHED);
         vec_push(&madt_ioapics, ap);
         klog("madt: IOAPIC[%d] maps to GSIs %d-%d!", ap->id, ap->gsib,
              ap->gsib + max_redir(madt_ioapics.length - 1));
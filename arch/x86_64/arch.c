@@ -61,44 +61,89 @@ void mg_disable() {
 }
 
 bool mg_validate(uintptr_t ptr, size_t len) {
-  if (len <= VM_PAGE_SIZE) {
-    // TODO: Check if range is mapped
-    if ((uintptr_t)ptr > VM_MEM_OFFSET)
-      return false;
-    else if (ptr == 0x0)
-      return false;
-  } else {
-    for (size_t i = 0; i < len; i += VM_PAGE_SIZE) {
-      if (!mg_validate(ptr + i, VM_PAGE_SIZE))
-        return false;
-    }
+  // TODO: Check if range is mapped (faults are caught by the fixups below)
+  if (ptr == 0x0 || ptr + len < ptr)
+    return false;
+
+  return (ptr + len) <= VM_MEM_OFFSET;
+}
+
+struct ex_entry {
+  uintptr_t fault_rip;
+  uintptr_t fixup_rip;
+};
+
+// Defined in kernel.ld, and filled by usercopy.asm
+extern struct ex_entry __ex_table_start[], __ex_table_end[];
+
+uintptr_t mg_find_fixup(uintptr_t rip) {
+  for (struct ex_entry* e = __ex_table_start; e < __ex_table_end; e++) {
+    if (e->fault_rip == rip)
+      return e->fixup_rip;
   }
 
-  return true;
+  return 0;
 }
 
-bool mg_copy_to_user(void* usrptr, void* srcptr, size_t len) {
-  mg_disable();
+extern size_t asm_copy_user_erms(void* dest, const void* src, size_t len);
+extern size_t asm_copy_user_slow(void* dest, const void* src, size_t len);
+extern size_t asm_clear_user(void* dest, size_t len);
+extern ssize_t asm_strncpy_user(char* dest, const char* src, size_t len);
+
+// 'rep movsb' beats everything else once ERMS (or FSRM for short copies) is
+// around, otherwise copy in qwords
+static size_t copy_user(void* dest, const void* src, size_t len) {
+  if (CPU_CHECK(CPU_FEAT_ERMS) || CPU_CHECK(CPU_FEAT_FSRM))
+    return asm_copy_user_erms(dest, src, len);
+  else
+    return asm_copy_user_slow(dest, src, len);
+}
 
-  // Check the entire address range we access, in uint32_t chunks
-  if (!mg_validate((uintptr_t)usrptr, len))
+bool copy_to_user(void* usrptr, const void* kernptr, size_t len) {
+  if (len == 0)
+    return true;
+  else if (!mg_validate((uintptr_t)usrptr, len))
     return false;
 
-  memcpy(usrptr, srcptr, len);
+  mg_disable();
+  size_t left = copy_user(usrptr, kernptr, len);
   mg_enable();
-  return true;
+  return left == 0;
 }
 
-bool mg_copy_from_user(void* kernptr, void* srcptr, size_t len) {
+bool copy_from_user(void* kernptr, const void* usrptr, size_t len) {
+  if (len == 0)
+    return true;
+  else if (!mg_validate((uintptr_t)usrptr, len))
+    return false;
+
   mg_disable();
+  size_t left = copy_user(kernptr, usrptr, len);
+  mg_enable();
+  return left == 0;
+}
 
-  // Check the entire address range we access, in uint32_t chunks
-  if (!mg_validate((uintptr_t)srcptr, len))
+bool clear_user(void* usrptr, size_t len) {
+  if (len == 0)
+    return true;
+  else if (!mg_validate((uintptr_t)usrptr, len))
     return false;
 
-  memcpy(kernptr, srcptr, len);
+  mg_disable();
+  size_t left = asm_clear_user(usrptr, len);
   mg_enable();
-  return true;
+  return left == 0;
 }
 
+ssize_t strncpy_from_user(char* kernptr, const char* usrptr, size_t len) {
+  // Only the start of the string has to be valid, so clamp the length to
+  // the end of userspace rather than rejecting it outright
+  if (usrptr == NULL || (uintptr_t)usrptr >= VM_MEM_OFFSET)
+    return -1;
+  len = MIN(len, VM_MEM_OFFSET - (uintptr_t)usrptr);
 
+  mg_disable();
+  ssize_t result = asm_strncpy_user(kernptr, usrptr, len);
+  mg_enable();
+  return result;
+}
@@ -5,8 +5,10 @@
 #include <arch/arch.h>
 #include <lib/builtin.h>
 #include <lib/kcon.h>
+#include <lib/lock.h>
 #include <ninex/proc.h>
 #include <vm/phys.h>
+#include <vm/virt.h>
 #include <vm/vm.h>
 
 // XSAVE features not supported by 9x...
@@ -18,17 +20,31 @@
 // Store the kernel stack at 0x70000000000
 #define THREAD_STACK_BASE 0x70000000000
 
+// Kernel stacks of dead threads, kept around on each CPU so that creating a
+// thread doesn't always need a fresh (zeroed) allocation
+#define KSTACK_PAGES 16
+#define KSTACK_CACHE_SIZE 4
+
+struct kstack_cache {
+  lock_t lock;
+  uintptr_t stacks[KSTACK_CACHE_SIZE];
+  size_t count;
+};
+
 enum {
-  FPU_INSTR_FX,  // FXSAVE/FXRSTOR
-  FPU_INSTR_X,   // XSAVE/XRSTOR
-  FPU_INSTR_XC,  // XSAVEC/XRSTOR
-  FPU_INSTR_XS,  // XSAVES/XRSTORS
+  FPU_INSTR_FX,    // FXSAVE/FXRSTOR
+  FPU_INSTR_X,     // XSAVE/XRSTOR
+  FPU_INSTR_XOPT,  // XSAVEOPT/XRSTOR
+  FPU_INSTR_XC,    // XSAVEC/XRSTOR
+  FPU_INSTR_XS,    // XSAVES/XRSTORS
 } fpu_mode = FPU_INSTR_FX;
 
 uint64_t cpu_features = 0;
 uint64_t fpu_save_size = 0;
+static uint64_t fpu_xcr0 = 0;
+static DEFINE_PERCPU(struct kstack_cache, kstack_cache);
 extern void asm_syscall_entry();
-extern void sched_spinup(cpu_ctx_t* context);
+extern void sched_spinup(cpu_ctx_t* context, bool* prev_on_cpu);
 
 static char* mode_to_str(int mode) {
   switch (mode) {
@@ -38,6 +54,9 @@ static char* mode_to_str(int mode) {
     case FPU_INSTR_X:
       return "XSAVE";
 
+    case FPU_INSTR_XOPT:
+      return "XSAVEOPT";
+
     case FPU_INSTR_XC:
       return "XSAVEC";
 
@@ -57,6 +76,7 @@ void fpu_save(uint8_t* zone) {
       break;
 
     case FPU_INSTR_X:
+    case FPU_INSTR_XOPT:
     case FPU_INSTR_XC:
     case FPU_INSTR_XS:
       if (((uintptr_t)zone % 64) != 0)
@@ -76,6 +96,12 @@ void fpu_save(uint8_t* zone) {
                    : "memory");
       break;
 
+    case FPU_INSTR_XOPT:
+      asm volatile("xsaveopt64 %[zone]" ::[zone] "m"(*zone), "a"(0xFFFFFFFF),
+                   "d"(0xFFFFFFFF)
+                   : "memory");
+      break;
+
     case FPU_INSTR_XC:
       asm volatile("xsavec %[zone]" ::[zone] "m"(*zone), "a"(0xFFFFFFFF),
                    "d"(0xFFFFFFFF)
@@ -104,6 +130,7 @@ void fpu_restore(uint8_t* zone) {
       break;
 
     case FPU_INSTR_X:
+    case FPU_INSTR_XOPT:
     case FPU_INSTR_XC:
     case FPU_INSTR_XS:
       if (((uintptr_t)zone % 64) != 0)
@@ -118,6 +145,7 @@ void fpu_restore(uint8_t* zone) {
       break;
 
     case FPU_INSTR_X:
+    case FPU_INSTR_XOPT:
     case FPU_INSTR_XC:
       asm volatile("xrstorq %[zone]" ::[zone] "m"(*zone), "a"(0xFFFFFFFF),
                    "d"(0xFFFFFFFF)
@@ -142,16 +170,16 @@ static void fpu_init() {
   if (CPU_CHECK(CPU_FEAT_XSAVE)) {
     uint32_t a, b, c, d;
     asm_write_cr4(asm_read_cr4() | (1 << 18));
-    fpu_mode = FPU_INSTR_X;
 
-    // Check for XSAVEC/XSAVES
-    cpuid_subleaf(0xD, 1, &a, &b, &c, &d);
-    if (a & CPUID_EAX_XSAVEC) {
-      fpu_mode = FPU_INSTR_XC;
+    // Setup xcr0 to save relevant features, which has to happen before
+    // querying the save size (since it depends on xcr0)
+    cpuid_subleaf(0xD, 0, &a, &b, &c, &d);
+    fpu_xcr0 = (a & ~XSAVE_UNSUPPORTED_MASK);
+    asm_wrxcr(0, fpu_xcr0);
 
-      cpuid_subleaf(0xD, 0, &a, &b, &c, &d);
-      fpu_save_size = b;
-    }
+    // Prefer XSAVES/XSAVEOPT, which skip components that weren't modified
+    // since they were last restored, over XSAVEC (which only compacts)
+    cpuid_subleaf(0xD, 1, &a, &b, &c, &d);
     if (a & CPUID_EAX_XCR0_BNDREGS) {
       fpu_mode = FPU_INSTR_XS;
 
@@ -159,28 +187,33 @@ static void fpu_init() {
       // of supervisor saving/restoring, so clear
       // the IA32_XSS MSR
       asm_wrmsr(0x0DA0, 0);
+      cpuid_subleaf(0xD, 1, &a, &b, &c, &d);
       fpu_save_size = b;
+    } else if (a & CPUID_EAX_XSAVEOPT) {
+      fpu_mode = FPU_INSTR_XOPT;
+    } else if (a & CPUID_EAX_XSAVEC) {
+      fpu_mode = FPU_INSTR_XC;
+      fpu_save_size = b;
+    } else {
+      fpu_mode = FPU_INSTR_X;
     }
 
-    // Setup xcr0 to save relevant features
-    cpuid_subleaf(0xD, 0, &a, &b, &c, &d);
-    uint64_t xcr0 = (a & ~XSAVE_UNSUPPORTED_MASK);
-    asm_wrxcr(0, xcr0);
-
     // Dump supported features
-    if (xcr0 & 3) {
+    if (fpu_xcr0 & 3) {
       klog("fpu: saving x87 & SSE state with %s", mode_to_str(fpu_mode));
     }
-    if (xcr0 & 4) {
+    if (fpu_xcr0 & 4) {
       klog("fpu: saving AVX state with %s", mode_to_str(fpu_mode));
     }
-    if (xcr0 & 224) {
+    if (fpu_xcr0 & 224) {
       klog("fpu: saving AVX-512 state with %s", mode_to_str(fpu_mode));
     }
 
-    // Find the save size for XSAVE, and print to the user
-    if (fpu_save_size == 0)
-      fpu_save_size = (uint64_t)c;
+    // Find the save size for the standard format, and print to the user
+    if (fpu_save_size == 0) {
+      cpuid_subleaf(0xD, 0, &a, &b, &c, &d);
+      fpu_save_size = (uint64_t)b;
+    }
 
     klog("fpu: using extended FPU save/restore with context size of %d!",
          fpu_save_size);
@@ -191,6 +224,38 @@ static void fpu_init() {
   }
 }
 
+// Allocates a save area holding the initial FPU state, where everything is
+// zero except for the default control words (exceptions masked, etc.). The
+// XSAVE header is all zeros as well, so XRSTOR puts every component in its
+// init state, while the compacted formats also need XCOMP_BV filled in.
+static void* fpu_alloc_area() {
+  uint8_t* area = kmalloc(fpu_save_size);  // Big enough to be 64-byte aligned
+
+  *(uint16_t*)(area + 0) = 0x37F;    // FCW
+  *(uint32_t*)(area + 24) = 0x1F80;  // MXCSR
+
+  if (fpu_mode == FPU_INSTR_XC || fpu_mode == FPU_INSTR_XS)
+    *(uint64_t*)(area + 520) = (1ull << 63) | fpu_xcr0;
+
+  return area;
+}
+
+// Makes sure that the FPU holds the current thread's state before it heads
+// back to usermode, since cpu_restore_thread leaves that to us. Restoring is
+// skipped entirely if nothing else used the FPU since the thread last ran
+// here. Must be called with interrupts disabled.
+void fpu_return_to_user() {
+  struct percpu_info* cpu = this_cpu;
+  thread_t* thrd = cpu->cur_thread;
+  if (thrd == NULL || thrd->fpu_save_area == NULL) return;
+
+  if (cpu->fpu_owner != thrd || thrd->fpu_cpu != cpu->proc_id) {
+    fpu_restore(thrd->fpu_save_area);
+    cpu->fpu_owner = thrd;
+    thrd->fpu_cpu = cpu->proc_id;
+  }
+}
+
 static void detect_cpu_features() {
   uint32_t eax, ebx, ecx, edx;
 
@@ -206,6 +271,9 @@ static void detect_cpu_features() {
   }
 
   cpuid_subleaf(0x7, 0x0, &eax, &ebx, &ecx, &edx);
+  if (ebx & CPUID_EBX_FSGSBASE) {
+    cpu_features |= CPU_FEAT_FSGSBASE;
+  }
   if (ecx & CPUID_ECX_RDPID) {
     cpu_features |= CPU_FEAT_RDPID;
   }
@@ -215,6 +283,12 @@ static void detect_cpu_features() {
   if (ebx & CPUID_EBX_INVPCID) {
     cpu_features |= CPU_FEAT_INVPCID;
   }
+  if (ebx & CPUID_EBX_ERMS) {
+    cpu_features |= CPU_FEAT_ERMS;
+  }
+  if (edx & CPUID_EDX_FSRM) {
+    cpu_features |= CPU_FEAT_FSRM;
+  }
 
   cpuid_subleaf(0x80000007, 0x0, &eax, &ebx, &ecx, &edx);
   if (edx & CPUID_EDX_INVARIANT) {
@@ -226,6 +300,9 @@ static void detect_cpu_features() {
     cpu_features |= CPU_FEAT_TCE;
     klog("cpu: using translation cache extension on AMD!");
   }
+  if (edx & CPUID_EDX_PAGE1GB) {
+    cpu_features |= CPU_FEAT_PAGE1GB;
+  }
 
   // Set the last bit so that we don't run this function more than once
   cpu_features |= (1ull << 63ull);
@@ -279,67 +356,156 @@ void cpu_early_init() {
   if (CPU_CHECK(CPU_FEAT_SMAP))
     cr4 |= (1 << 21);
 
+  // Enable RD/WR{FS,GS}BASE instructions
+  if (CPU_CHECK(CPU_FEAT_FSGSBASE))
+    cr4 |= (1 << 16);
+
   // Enable X{SAVE,RSTOR} instructions
   if (CPU_CHECK(CPU_FEAT_XSAVE))
     cr4 |= (1 << 18);
   asm_write_cr4(cr4);
 
+  // The BSP already did this in fpu_init, but the APs still need to enable
+  // the same set of features
+  if (CPU_CHECK(CPU_FEAT_XSAVE)) {
+    asm_wrxcr(0, fpu_xcr0);
+    if (fpu_mode == FPU_INSTR_XS)
+      asm_wrmsr(0x0DA0, 0);
+  }
+
   // Setup the syscall instruction
   asm_wrmsr(IA32_STAR, ((uint64_t)(GDT_KERNEL_DATA | 3)) << 48 | ((uint64_t)GDT_KERNEL_CODE) << 32);
   asm_wrmsr(IA32_LSTAR, (uintptr_t)asm_syscall_entry);
   asm_wrmsr(IA32_SFMASK, ~(uint32_t)2);
 
-  // Finally, disable floating point emulation (for SSE)
-  asm_write_cr0((asm_read_cr0() & ~(1 << 2)) | (1 << 1));
+  // Finally, disable floating point emulation (for SSE), and make the kernel
+  // respect read-only pages (so that writes to the zero page/COW pages fault)
+  asm_write_cr0((asm_read_cr0() & ~(1 << 2)) | (1 << 1) | (1 << 16));
 }
 
-void cpu_save_thread(cpu_ctx_t* context) {
-  this_cpu->cur_thread->context = *context;
+// While in the kernel, the user's GS base is swapped out into KERNEL_GS_BASE,
+// which FSGSBASE can only get at by swapping it back in temporarily
+static void save_user_bases(thread_t* thrd) {
+  if (CPU_CHECK(CPU_FEAT_FSGSBASE)) {
+    thrd->client_fs = asm_rdfsbase();
+    asm_swapgs();
+    thrd->client_gs = asm_rdgsbase();
+    asm_swapgs();
+  } else {
+    thrd->client_fs = asm_rdmsr(IA32_FS_BASE);
+    thrd->client_gs = asm_rdmsr(IA32_KERNEL_GS_BASE);
+  }
+}
 
-  // Only save FPU/percpu stuff on usermode threads
-  if (this_cpu->cur_thread->fpu_save_area) {
-    this_cpu->cur_thread->client_gs = asm_rdmsr(IA32_GS_BASE);
-    this_cpu->cur_thread->client_fs = asm_rdmsr(IA32_FS_BASE);
-    fpu_save(this_cpu->cur_thread->fpu_save_area);
+static void restore_user_bases(thread_t* thrd) {
+  if (CPU_CHECK(CPU_FEAT_FSGSBASE)) {
+    asm_wrfsbase(thrd->client_fs);
+    asm_swapgs();
+    asm_wrgsbase(thrd->client_gs);
+    asm_swapgs();
+  } else {
+    asm_wrmsr(IA32_FS_BASE, thrd->client_fs);
+    asm_wrmsr(IA32_KERNEL_GS_BASE, thrd->client_gs);
   }
 }
 
-void cpu_restore_thread(cpu_ctx_t* context) {
-  thread_t* thrd = this_cpu->cur_thread;
+void cpu_save_thread(cpu_ctx_t* context) {
+  struct percpu_info* cpu = this_cpu;
+  thread_t* thrd = cpu->cur_thread;
+  thrd->context = *context;
 
-  // If the FPU context is present, then the
-  // segment registers need to be attended to as well
+  // Only save FPU/percpu stuff on usermode threads, where the FPU state only
+  // needs saving if it was ever loaded (see fpu_return_to_user). Checking
+  // 'fpu_cpu' too keeps a recycled thread from matching its predecessor.
   if (thrd->fpu_save_area) {
-    asm_wrmsr(IA32_GS_BASE, thrd->client_gs);
-    asm_wrmsr(IA32_FS_BASE, thrd->client_fs);
-    fpu_restore(thrd->fpu_save_area);
+    save_user_bases(thrd);
+    if (cpu->fpu_owner == thrd && thrd->fpu_cpu == cpu->proc_id)
+      fpu_save(thrd->fpu_save_area);
   }
+}
 
-  if (this_cpu->cur_spc != thrd->parent->space) {
-    vm_space_load(thrd->parent->space);
-    this_cpu->cur_spc = thrd->parent->space;
+void cpu_restore_thread(cpu_ctx_t* context, thread_t* prev) {
+  (void)context;
+  thread_t* thrd = this_cpu_read(cur_thread);
+  cpu_ctx_t* new_context = &thrd->context;
+
+  // If the FPU context is present, then the segment registers need to be
+  // attended to as well. Loading the FPU is put off until the thread returns
+  // to usermode, which is right now if it was preempted there.
+  if (thrd->fpu_save_area) {
+    restore_user_bases(thrd);
+    if (new_context->cs & 3)
+      fpu_return_to_user();
   }
 
-  this_cpu->kernel_stack = thrd->syscall_stack;
-  cpu_ctx_t* new_context = &this_cpu->cur_thread->context;
+  // Kernel threads have no user mappings, so they just borrow the space
+  // that's already loaded (see hat_sync_tlb)
+  vm_space_t* spc = thrd->parent->space;
+  if (spc != &kernel_space && this_cpu_read(cur_spc) != spc)
+    vm_space_load(spc);
+
+  this_cpu_write(kernel_stack, thrd->syscall_stack);
 
   if (new_context->cs & 3)
     asm_swapgs();
-  sched_spinup(new_context);
+
+  // The previous thread can't run elsewhere until we're off its stack, which
+  // sched_spinup signals once it switched over
+  sched_spinup(new_context, (prev && prev != thrd) ? &prev->on_cpu : NULL);
+}
+
+// Returns the top of a new kernel stack, reusing one that a dead thread left
+// in the cache if possible (which isn't zeroed, unlike fresh ones)
+static uintptr_t alloc_kstack() {
+  uintptr_t stack = 0;
+
+  if (this_cpu_or_null != NULL) {
+    struct kstack_cache* cache = this_cpu_ptr(kstack_cache);
+    bool irq = spinlock_irq(&cache->lock);
+    if (cache->count > 0)
+      stack = cache->stacks[--cache->count];
+    spinrelease_irq(&cache->lock, irq);
+  }
+
+  if (stack == 0) {
+    stack = (uintptr_t)vm_phys_alloc(KSTACK_PAGES, VM_ALLOC_ZERO);
+    stack += VM_MEM_OFFSET + (KSTACK_PAGES * VM_PAGE_SIZE);
+  }
+
+  return stack;
+}
+
+static void free_kstack(uintptr_t stack) {
+  struct kstack_cache* cache = this_cpu_ptr(kstack_cache);
+  bool irq = spinlock_irq(&cache->lock);
+  if (cache->count < KSTACK_CACHE_SIZE) {
+    cache->stacks[cache->count++] = stack;
+    stack = 0;
+  }
+  spinrelease_irq(&cache->lock, irq);
+
+  if (stack != 0)
+    vm_phys_free((void*)(stack - VM_MEM_OFFSET - (KSTACK_PAGES * VM_PAGE_SIZE)),
+                 KSTACK_PAGES);
+}
+
+void cpu_destroy_ctx(thread_t* thrd) {
+  free_kstack(thrd->syscall_stack);
+  if (thrd->fpu_save_area)
+    kfree(thrd->fpu_save_area);
 }
 
 void cpu_create_kctx(thread_t* thrd, uintptr_t entry, uint64_t arg1) {
   cpu_ctx_t* context = &thrd->context;
 
   // Create a 64KB stack...
-  uintptr_t stack = (uintptr_t)vm_phys_alloc(16, VM_ALLOC_ZERO);
-  stack += VM_MEM_OFFSET + (16 * VM_PAGE_SIZE);
+  thrd->syscall_stack = alloc_kstack();
 
   context->rdi = arg1;
   context->cs = GDT_KERNEL_CODE;
   context->ss = GDT_KERNEL_DATA;
   context->rflags = 0x202;
-  context->rsp = stack;
+  context->rsp = thrd->syscall_stack;
   context->rip = entry;
 }
 
@@ -353,17 +519,23 @@ void cpu_create_kctx(thread_t* thrd, uintptr_t entry, uint64_t arg1) {
 void cpu_create_uctx(thread_t* thrd, struct exec_args args, bool elf) {
   cpu_ctx_t* context = &thrd->context;
 
-  // Create a 32KB user stack (mapped at 0x70000000000)...
+  // Create a 32KB user stack (mapped at 0x70000000000), as a segment so that
+  // it gets carried over on fork...
   uintptr_t stack_base = 0x0;
   if (elf) {
+    struct vm_seg* stack_seg =
+        vm_create_seg(MAP_ANON | __MAP_EMBED_ONLY | MAP_PRIVATE,
+                      PROT_READ | PROT_WRITE, 8 * VM_PAGE_SIZE);
     stack_base = (uintptr_t)vm_phys_alloc(8, VM_ALLOC_ZERO);
-    vm_map_range(thrd->parent->space, stack_base, (uintptr_t)THREAD_STACK_BASE,
-                 8 * VM_PAGE_SIZE, VM_PERM_READ | VM_PERM_WRITE | VM_PERM_USER);
+    vm_seg_embed(stack_seg, thrd->parent->space, THREAD_STACK_BASE, stack_base);
   }
 
-  // And a 16KB kernel stack
-  thrd->syscall_stack = (uintptr_t)vm_phys_alloc(16, VM_ALLOC_ZERO);
-  thrd->syscall_stack += VM_MEM_OFFSET + (16 * VM_PAGE_SIZE);
+  // And a 64KB kernel stack
+  thrd->syscall_stack = alloc_kstack();
+
+  // Along with a clean FPU state, that hasn't been loaded anywhere yet
+  thrd->fpu_save_area = fpu_alloc_area();
+  thrd->fpu_cpu = -1;
 
   // Fill in the initial values of the context
   context->cs = GDT_USER_CODE | 3;
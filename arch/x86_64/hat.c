@@ -1,10 +1,15 @@
+#include <arch/arch.h>
 #include <arch/asm.h>
 #include <arch/cpu.h>
 #include <arch/cpuid.h>
 #include <arch/hat.h>
 #include <arch/irqchip.h>
+#include <arch/smp.h>
+#include <lib/builtin.h>
 #include <lib/cmdline.h>
+#include <lib/htab.h>
 #include <lib/kcon.h>
+#include <ninex/irq.h>
 #include <vm/phys.h>
 #include <vm/virt.h>
 #include <vm/vm.h>
@@ -17,21 +22,165 @@ struct vm_config possible_x86_modes[] = {
     {0xFF00000000000000, 5, 4096, 4096, 4096 * 512}};
 struct vm_config* cur_config = NULL;
 static bool log_pagefault = false;
-static lock_t hat_lock;
 
 // Set defaults to match 4LV paging
 uintptr_t kernel_vma = 0xFFFF800000000000;
 
-static uint64_t* next_level(uint64_t* prev_level, uint64_t index, bool create) {
+// Physical address bits of a paging entry
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000
+
+// Software bit marking a PDE whose page table is shared between spaces
+#define PDE_SHARED (1 << 9)
+
+// Reference counts of shared page tables, keyed by their physical address
+static struct hash_table shared_pts;
+static lock_t shared_pt_lock;
+
+// Page tables come from a per-CPU cache of zeroed pages, which is refilled
+// in batches from the physical allocator. Tables are always zeroed before
+// they're freed, so they can go straight back into the cache.
+static void refill_pts(struct percpu_info* cpu) {
+  size_t count = HAT_PT_CACHE / 4;
+  uintptr_t batch = (uintptr_t)vm_phys_alloc(count, VM_ALLOC_ZERO);
+  if (batch == 0)
+    return;
+
+  for (size_t i = 0; i < count; i++)
+    cpu->pt_cache[cpu->pt_cached++] = batch + (i * VM_PAGE_SIZE);
+}
+
+static uintptr_t alloc_pt(vm_space_t* spc) {
+  struct percpu_info* cpu = this_cpu_or_null;
+  uintptr_t pt = 0;
+
+  if (cpu != NULL) {
+    bool irq = asm_check_intr();
+    asm volatile("cli");
+
+    if (cpu->pt_cached == 0)
+      refill_pts(cpu);
+    if (cpu->pt_cached != 0)
+      pt = cpu->pt_cache[--cpu->pt_cached];
+
+    if (irq)
+      asm volatile("sti");
+  }
+
+  if (pt == 0)
+    pt = (uintptr_t)vm_phys_alloc(1, VM_ALLOC_ZERO);
+  if (pt != 0)
+    ATOMIC_INC(&spc->pt_pages);
+
+  return pt;
+}
+
+void hat_release_pts(uintptr_t list) {
+  struct percpu_info* cpu = this_cpu_or_null;
+  bool irq = asm_check_intr();
+  asm volatile("cli");
+
+  while (list != 0) {
+    uint64_t* pt = (uint64_t*)(list + VM_MEM_OFFSET);
+    uintptr_t next = pt[0];
+    pt[0] = 0;
+
+    if (cpu != NULL && cpu->pt_cached < HAT_PT_CACHE)
+      cpu->pt_cache[cpu->pt_cached++] = list;
+    else
+      vm_phys_free((void*)list, 1);
+
+    list = next;
+  }
+
+  if (irq)
+    asm volatile("sti");
+}
+
+// Queues a table onto a list for hat_release_pts, zeroing it if needed
+static void queue_pt(uintptr_t* list, uintptr_t pt, bool zeroed) {
+  uint64_t* table = (uint64_t*)(pt + VM_MEM_OFFSET);
+  if (!zeroed)
+    memset64(table, 0, VM_PAGE_SIZE);
+
+  table[0] = *list;
+  *list = pt;
+}
+
+static uint64_t* next_level(vm_space_t* spc,
+                            uint64_t* prev_level,
+                            uint64_t index,
+                            bool create) {
   if (!(prev_level[index] & 1)) {
     if (!create)
       return NULL;
 
-    prev_level[index] = (uint64_t)vm_phys_alloc(1, VM_ALLOC_ZERO);
-    prev_level[index] |= 0b111;
+    uintptr_t pt = alloc_pt(spc);
+    if (pt == 0)
+      return NULL;  // OOM has occured!
+
+    prev_level[index] = pt | 0b111;
+  }
+
+  return (uint64_t*)((prev_level[index] & PTE_ADDR_MASK) + VM_MEM_OFFSET);
+}
+
+// Drops a reference to a shared page table, returning true if it was the last
+static bool put_shared_pt(uintptr_t pt) {
+  spinlock(&shared_pt_lock);
+  uintptr_t refs = (uintptr_t)htab_find(&shared_pts, &pt, sizeof(uintptr_t));
+  htab_delete(&shared_pts, &pt, sizeof(uintptr_t));
+  if (refs > 1)
+    htab_insert(&shared_pts, &pt, sizeof(uintptr_t), (void*)(refs - 1));
+
+  spinrelease(&shared_pt_lock);
+  return (refs <= 1);
+}
+
+// Gives the space owning 'pde' a private copy of the page table it points to,
+// so that it can be modified. Since the pages themselves are still shared,
+// every PTE is write-protected in both copies. Returns false (leaving the
+// table shared) if there's no memory for the copy.
+static bool unshare_pt(vm_space_t* spc, uint64_t* pde) {
+  uintptr_t pt = *pde & PTE_ADDR_MASK;
+  uint64_t flags = (*pde & ~PTE_ADDR_MASK & ~PDE_SHARED) | (1 << 1);
+
+  // We were the last user, so just take the table back. Nobody else can
+  // start sharing it without going through our space, which is locked.
+  spinlock(&shared_pt_lock);
+  uintptr_t refs = (uintptr_t)htab_find(&shared_pts, &pt, sizeof(uintptr_t));
+  if (refs <= 1) {
+    htab_delete(&shared_pts, &pt, sizeof(uintptr_t));
+    spinrelease(&shared_pt_lock);
+    *pde = pt | flags;
+    return true;
+  }
+
+  spinrelease(&shared_pt_lock);
+
+  // Make the copy while we still hold our reference to the shared table
+  uintptr_t new_pt = alloc_pt(spc);
+  if (new_pt == 0)
+    return false;  // OOM has occured!
+
+  uint64_t* src = (uint64_t*)(pt + VM_MEM_OFFSET);
+  uint64_t* dest = (uint64_t*)(new_pt + VM_MEM_OFFSET);
+  for (size_t i = 0; i < 512; i++) {
+    src[i] &= ~(1ull << 1);
+    dest[i] = src[i];
   }
 
-  return (uint64_t*)((prev_level[index] & ~(0x1ff)) + VM_MEM_OFFSET);
+  // Then trade the reference for the copy, unless everyone else dropped
+  // theirs in the meantime, in which case the copy isn't needed after all
+  ATOMIC_DEC(&spc->pt_pages);
+  if (put_shared_pt(pt)) {
+    uintptr_t list = 0;
+    queue_pt(&list, new_pt, false);
+    hat_release_pts(list);
+    new_pt = pt;
+  }
+
+  *pde = new_pt | flags;
+  return true;
 }
 
 uintptr_t hat_get_base(enum base_type bt) {
@@ -56,11 +205,12 @@ uintptr_t hat_get_base(enum base_type bt) {
   return 0x0;
 }
 
-uint64_t* hat_translate_addr(uintptr_t root,
+uint64_t* hat_translate_addr(vm_space_t* spc,
                              uintptr_t virt,
-                             bool create,
+                             int flags,
                              int depth) {
-  uint64_t* cur = (uint64_t*)(root + VM_MEM_OFFSET);
+  bool create = (flags & TRANSLATE_CREATE);
+  uint64_t* cur = (uint64_t*)(spc->root + VM_MEM_OFFSET);
   uint64_t idx_map[] = {
 #define INDEX(shift) ((virt & ((uint64_t)0x1ff << shift)) >> shift)
       INDEX(48), INDEX(39), INDEX(30), INDEX(21), INDEX(12)
@@ -73,7 +223,7 @@ uint64_t* hat_translate_addr(uintptr_t root,
   // Perform the 5th layer translation, if needed...
   bool doing_5lv = (cur_config->levels == 5);
   if (doing_5lv) {
-    cur = next_level(cur, idx_map[0], create);
+    cur = next_level(spc, cur, idx_map[0], create);
     if (cur == NULL)
       return NULL;
   }
@@ -86,18 +236,318 @@ uint64_t* hat_translate_addr(uintptr_t root,
   else if (final)                        \
     return &sl[idx]; /* Bottom level */
 
-  cur = next_level(cur, idx_map[1], create);
-  if (cur == NULL)
-    return NULL;
+  cur = next_level(spc, cur, idx_map[1], create);
+  CHECK_PTE(cur, idx_map[2], false)
 
-  cur = next_level(cur, idx_map[2], create);
+  cur = next_level(spc, cur, idx_map[2], create);
   CHECK_PTE(cur, idx_map[3], (depth == TRANSLATE_DEPTH_HUGE))
 
-  cur = next_level(cur, idx_map[3], create);
+  // Make sure callers that are about to modify the PTE don't write to a
+  // table shared with another space
+  if ((flags & TRANSLATE_UNSHARE) && (cur[idx_map[3]] & PDE_SHARED) &&
+      !unshare_pt(spc, &cur[idx_map[3]]))
+    return NULL;  // OOM has occured!
+
+  cur = next_level(spc, cur, idx_map[3], create);
   CHECK_PTE(cur, idx_map[4], true)
 #undef CHECK_PTE
 }
 
+void hat_share_range(vm_space_t* src,
+                     vm_space_t* dest,
+                     uintptr_t virt,
+                     size_t len) {
+  uintptr_t end = virt + len;
+
+  for (virt = ALIGN_DOWN(virt, cur_config->huge_page_size); virt < end;
+       virt += cur_config->huge_page_size) {
+    uint64_t* src_pde =
+        hat_translate_addr(src, virt, 0, TRANSLATE_DEPTH_HUGE);
+    if (src_pde == NULL || !(*src_pde & 1))
+      continue;
+    else if (*src_pde & (1 << 7))
+      continue;  // Huge pages are never used for user segments
+
+    // Neighbouring segments may live in the same table, so only share it once
+    uint64_t* dest_pde =
+        hat_translate_addr(dest, virt, TRANSLATE_CREATE, TRANSLATE_DEPTH_HUGE);
+    if (dest_pde == NULL)
+      return;  // OOM has occured!
+    else if (*dest_pde & 1)
+      continue;
+
+    uintptr_t pt = *src_pde & PTE_ADDR_MASK;
+    spinlock(&shared_pt_lock);
+    uintptr_t refs = (uintptr_t)htab_find(&shared_pts, &pt, sizeof(uintptr_t));
+    htab_delete(&shared_pts, &pt, sizeof(uintptr_t));
+    htab_insert(&shared_pts, &pt, sizeof(uintptr_t),
+                (void*)(refs ? refs + 1 : 2));
+    spinrelease(&shared_pt_lock);
+    ATOMIC_INC(&dest->pt_pages);
+
+    // Clearing R/W in the PDE write-protects the entire 2MB region
+    *src_pde = (*src_pde & ~(1ull << 1)) | PDE_SHARED;
+    *dest_pde = *src_pde;
+  }
+}
+
+//////////////////////////
+//     Range Walker
+//////////////////////////
+// Walks the page tables covering [virt, end) in a single pass, descending
+// into each table once and calling 'leaf' on every entry at the bottom.
+struct hat_walker {
+  void (*leaf)(struct hat_walker* w, uint64_t* entry, uintptr_t virt,
+               size_t size);
+  bool create;  // Create missing tables on the way down
+  bool modify;  // Entries get modified, so shared tables must be unshared
+  bool prune;   // Free tables that are left empty
+  bool huge;    // Map using the largest pages that fit
+
+  vm_space_t* spc;
+  uintptr_t freed;  // Tables left empty, for hat_release_pts
+  size_t unmapped;  // Pages that were present before being unmapped
+
+  // Arguments for the leaf callbacks
+  uintptr_t virt, phys;
+  vm_flags_t flags;
+  hat_query_fn query;
+  void* arg;
+};
+
+// Permission bits that hat_protect_range is allowed to change
+#define PTE_PERM_MASK ((1ull << 63) | (1 << 2) | (1 << 1))
+
+static bool table_empty(uint64_t* table) {
+  for (size_t i = 0; i < 512; i++)
+    if (table[i] != 0)
+      return false;
+
+  return true;
+}
+
+// Breaks a huge page up into a table of smaller pages with the same
+// attributes, so that part of it can be changed
+static bool split_huge(vm_space_t* spc, uint64_t* entry, int level) {
+  uintptr_t table = alloc_pt(spc);
+  if (table == 0)
+    return false;
+
+  // The PAT bit lives in bit 12 for huge pages, but bit 7 for 4KB ones
+  size_t child_size = 1ull << (12 + (9 * (level - 2)));
+  uintptr_t phys = *entry & PTE_ADDR_MASK & ~(1ull << 12);
+  uint64_t attrs = *entry & ~PTE_ADDR_MASK;
+  bool pat = (*entry & (1 << 12));
+  if (level == 2) {
+    attrs &= ~(1 << 7);
+    if (pat)
+      attrs |= (1 << 7);
+  } else if (pat) {
+    attrs |= (1 << 12);
+  }
+
+  uint64_t* child = (uint64_t*)(table + VM_MEM_OFFSET);
+  for (size_t i = 0; i < 512; i++)
+    child[i] = (phys + (i * child_size)) | attrs;
+
+  *entry = table | 0b111;
+  return true;
+}
+
+// Counts the present entries of a leaf table
+static size_t count_present(uintptr_t pt) {
+  uint64_t* entries = (uint64_t*)(pt + VM_MEM_OFFSET);
+  size_t count = 0;
+
+  for (int i = 0; i < 512; i++)
+    count += (entries[i] & 1);
+
+  return count;
+}
+
+static void walk_level(uint64_t* table,
+                       int level,
+                       uintptr_t virt,
+                       uintptr_t end,
+                       struct hat_walker* w) {
+  int shift = 12 + (9 * (level - 1));
+  size_t size = 1ull << shift;
+  bool top = (level == cur_config->levels);
+  int max_huge = CPU_CHECK(CPU_FEAT_PAGE1GB) ? 3 : 2;
+
+  while (virt < end) {
+    uintptr_t next = MIN((virt & ~(size - 1)) + size, end);
+    uint64_t* entry = &table[(virt >> shift) & 0x1ff];
+    bool covered = ((virt & (size - 1)) == 0) && ((next - virt) == size);
+
+    // Use a huge page where the entire entry (and its physical memory) is
+    // aligned, unless there's already a table in the way
+    bool is_huge = (level > 1 && (*entry & 1) && (*entry & (1 << 7)));
+    bool fits = (w->huge && level <= max_huge && covered &&
+                 (!(*entry & 1) || is_huge) &&
+                 (((w->phys + (virt - w->virt)) & (size - 1)) == 0));
+
+    // Huge pages end the walk early, unless only part of one is modified,
+    // or it's being replaced by smaller pages (bit 7 is the PAT bit in a
+    // PTE, though)
+    if (is_huge && w->modify && !fits && (!covered || w->create)) {
+      if (!split_huge(w->spc, entry, level))
+        return;  // OOM has occured!
+    } else if (level == 1 || fits || is_huge) {
+      w->leaf(w, entry, virt, size);
+      virt = next;
+      continue;
+    }
+
+    if (!(*entry & 1)) {
+      if (!w->create) {
+        virt = next;
+        continue;
+      }
+
+      uintptr_t child = alloc_pt(w->spc);
+      if (child == 0)
+        return;  // OOM has occured!
+
+      *entry = child | 0b111;
+    }
+
+    if (level == 2 && w->prune && (next - virt) == size) {
+      // Leaf tables that are entirely covered can be dropped outright,
+      // without scrubbing them first
+      uintptr_t pt = *entry & PTE_ADDR_MASK;
+      w->unmapped += count_present(pt);
+      if (!(*entry & PDE_SHARED) || put_shared_pt(pt))
+        queue_pt(&w->freed, pt, false);
+
+      ATOMIC_DEC(&w->spc->pt_pages);
+      *entry = 0;
+      virt = next;
+      continue;
+    } else if (level == 2 && w->modify && (*entry & PDE_SHARED)) {
+      if (!unshare_pt(w->spc, entry))
+        return;  // OOM has occured!
+    }
+
+    uint64_t* child = (uint64_t*)((*entry & PTE_ADDR_MASK) + VM_MEM_OFFSET);
+    walk_level(child, level - 1, virt, next, w);
+
+    // The higher half of the top level is copied into every space, so the
+    // tables it points to have to stay around
+    bool shared_top = top && (((virt >> shift) & 0x1ff) >= 256);
+    if (w->prune && !shared_top && table_empty(child)) {
+      queue_pt(&w->freed, *entry & PTE_ADDR_MASK, true);
+      ATOMIC_DEC(&w->spc->pt_pages);
+      *entry = 0;
+    }
+
+    virt = next;
+  }
+}
+
+static void walk_range(vm_space_t* spc,
+                       uintptr_t virt,
+                       size_t len,
+                       struct hat_walker* w) {
+  w->spc = spc;
+  walk_level((uint64_t*)(spc->root + VM_MEM_OFFSET), cur_config->levels, virt,
+             virt + len, w);
+}
+
+static void map_leaf(struct hat_walker* w,
+                     uint64_t* entry,
+                     uintptr_t virt,
+                     size_t size) {
+  *entry = hat_create_pte(w->flags, w->phys + (virt - w->virt),
+                          size > cur_config->page_size);
+}
+
+static void unmap_leaf(struct hat_walker* w,
+                       uint64_t* entry,
+                       uintptr_t virt,
+                       size_t size) {
+  (void)virt;
+  if (*entry & 1)
+    w->unmapped += size / cur_config->page_size;
+
+  *entry = 0;
+}
+
+static void protect_leaf(struct hat_walker* w,
+                         uint64_t* entry,
+                         uintptr_t virt,
+                         size_t size) {
+  (void)virt;
+  (void)size;
+  if (!(*entry & 1))
+    return;
+
+  // Write access is only ever taken away here, since the page might be
+  // copy-on-write (the VM grants it back on the next write fault)
+  uint64_t perms = hat_create_pte(w->flags, 0, false) & PTE_PERM_MASK;
+  perms &= (*entry & (1 << 1)) | ~(1ull << 1);
+  *entry = (*entry & ~PTE_PERM_MASK) | perms;
+}
+
+static void query_leaf(struct hat_walker* w,
+                       uint64_t* entry,
+                       uintptr_t virt,
+                       size_t size) {
+  if (!(*entry & 1))
+    return;
+
+  // Report the start of the page, even if the walk started in the middle
+  w->query(virt & ~(size - 1), *entry & PTE_ADDR_MASK & ~(size - 1), size,
+           w->arg);
+}
+
+void hat_map_range(vm_space_t* spc,
+                   uintptr_t phys,
+                   uintptr_t virt,
+                   size_t len,
+                   vm_flags_t flags) {
+  struct hat_walker w = {.leaf = map_leaf,
+                         .create = true,
+                         .modify = true,
+                         .huge = (flags & VM_PAGE_HUGE) ? true : false,
+                         .virt = virt,
+                         .phys = phys,
+                         .flags = flags};
+
+  walk_range(spc, virt, len, &w);
+}
+
+size_t hat_unmap_range(vm_space_t* spc,
+                       uintptr_t virt,
+                       size_t len,
+                       uintptr_t* freed) {
+  // Nobody gets shot down for the kernel space, so its tables have to stay
+  struct hat_walker w = {.leaf = unmap_leaf,
+                         .modify = true,
+                         .prune = (spc != &kernel_space)};
+  walk_range(spc, virt, len, &w);
+
+  *freed = w.freed;
+  return w.unmapped;
+}
+
+void hat_protect_range(vm_space_t* spc,
+                       uintptr_t virt,
+                       size_t len,
+                       vm_flags_t flags) {
+  struct hat_walker w = {.leaf = protect_leaf, .modify = true, .flags = flags};
+  walk_range(spc, virt, len, &w);
+}
+
+void hat_query_range(vm_space_t* spc,
+                     uintptr_t virt,
+                     size_t len,
+                     hat_query_fn fn,
+                     void* arg) {
+  struct hat_walker w = {.leaf = query_leaf, .query = fn, .arg = arg};
+  walk_range(spc, virt, len, &w);
+}
+
 uint64_t hat_create_pte(vm_flags_t flags, uintptr_t phys, bool is_block) {
   uint64_t pte_raw = 1;  // PTE must always be present
 
@@ -120,16 +570,17 @@ uint64_t hat_create_pte(vm_flags_t flags, uintptr_t phys, bool is_block) {
     klog("hat: (WARN) x86_64 does not support non-readable mappings! (0x%x)",
          flags);
 
-  // Set proper cache type
+  // Set proper cache type, by picking the PAT entry (PAT:PCD:PWT) holding
+  // it, see hat_init for the layout
   switch (flags & VM_CACHE_MASK) {
     case VM_CACHE_UNCACHED:
-      pte_raw |= ~(1 << (is_block ? 12 : 7)) | (1 << 4) | (1 << 3);
+      pte_raw |= (1 << 4) | (1 << 3);  // PA3
       break;
     case VM_CACHE_WRITE_COMBINING:
-      pte_raw |= (1 << (is_block ? 12 : 7)) | (1 << 4) | (1 << 3);
+      pte_raw |= (1 << (is_block ? 12 : 7)) | (1 << 4) | (1 << 3);  // PA7
       break;
     case VM_CACHE_WRITE_PROTECT:
-      pte_raw |= (1 << (is_block ? 12 : 7)) | (1 << 4) | ~(1 << 3);
+      pte_raw |= (1 << (is_block ? 12 : 7)) | (1 << 4);  // PA6
       break;
     default:
       break;  // Use the default memory type (Write Back),
@@ -141,96 +592,260 @@ uint64_t hat_create_pte(vm_flags_t flags, uintptr_t phys, bool is_block) {
   return pte_raw;
 }
 
-void hat_invl(uintptr_t root, uintptr_t virt, uint32_t asid, int mode) {
-  spinlock(&hat_lock);
+// Adds/removes a CPU from the set of CPUs that have a space loaded
+static void track_space(vm_space_t* s, uint16_t cpu, bool loaded) {
+  if (s == &kernel_space)
+    return;
 
-  if (CPU_CHECK(CPU_FEAT_PCID)) {
-    // Use the INVPCID instruction, if supported!
-    if (CPU_CHECK(CPU_FEAT_INVPCID)) {
-      struct invpcid_descriptor {
-        uint64_t pcid;
-        uint64_t addr;
-      } desc = { .pcid = asid, .addr = virt };
-
-      __asm__ volatile("invpcid %1, %0" : : "r"((uint64_t)(mode - 0x10)), "m"(desc) : "memory");
-    } else {
-      uint64_t old_cr3, new_cr3;
-      switch (mode) {
-      case INVL_SINGLE_ADDR:
-        asm_invlpg(virt);
-        break;
-
-      case INVL_SINGLE_ASID:
-        old_cr3 = asm_read_cr3();
-        new_cr3 = (uint16_t)asid | kernel_space.root;
-        new_cr3 &= ~(1ull << 63);  // Clear bit 63, to invalidate the PCID
-
-        asm_write_cr3(new_cr3);
-        asm_write_cr3(old_cr3);
-        break;
-
-      case INVL_ALL_ASIDS:  // TODO: Find a way to invalidate all ASIDs, without invalidating global pages
-      case INVL_ENTIRE_TLB:
-        asm_write_cr4(asm_read_cr4() & ~(1 << 7));
-        asm_write_cr4(asm_read_cr4() | (1 << 7));
-        __asm__ volatile ("wbinvd" ::: "memory");
-        break;
-
-      default:
-        klog("hat: Invalidation mode %d is not supported!", mode); 
-      }
-    }
-  } else {
-    // ASIDs (aka PCIDs) are not supported, just run invlpg, or clear the entire TLB
-    switch (mode) {
-    case INVL_SINGLE_ADDR:
+  uint64_t bit = 1ull << (cpu % 64);
+  if (loaded)
+    __atomic_fetch_or(&s->cpus[cpu / 64], bit, __ATOMIC_SEQ_CST);
+  else
+    __atomic_fetch_and(&s->cpus[cpu / 64], ~bit, __ATOMIC_SEQ_CST);
+}
+
+// Finds the PCID that 's' is cached under on this CPU (or -1 if it isn't)
+static int find_asid(vm_space_t* s) {
+  if (s == &kernel_space || !CPU_CHECK(CPU_FEAT_PCID))
+    return 0;
+
+  for (int i = 0; i < HAT_NR_ASIDS; i++)
+    if (this_cpu->asid_slots[i].ctx_id == s->ctx_id)
+      return i + 1;
+
+  return -1;
+}
+
+static inline void invpcid(uint64_t type, uint64_t pcid, uintptr_t virt) {
+  struct invpcid_descriptor {
+    uint64_t pcid;
+    uint64_t addr;
+  } desc = { .pcid = pcid, .addr = virt };
+
+  __asm__ volatile("invpcid %1, %0" : : "r"(type), "m"(desc) : "memory");
+}
+
+void hat_invl(vm_space_t* spc, uintptr_t virt, int mode) {
+  uint64_t gen;
+  int pcid = 0;
+  if (mode == INVL_SINGLE_ADDR || mode == INVL_SINGLE_ASID) {
+    // Spaces that aren't cached on this CPU have nothing to flush, and will
+    // get a fresh PCID when they're loaded again
+    pcid = find_asid(spc);
+    if (pcid < 0)
+      return;
+  }
+
+  uint64_t cr3 = asm_read_cr3();
+  bool loaded = ((cr3 & PTE_ADDR_MASK) == spc->root);
+
+  switch (mode) {
+  case INVL_SINGLE_ADDR:
+    if (loaded || spc == &kernel_space)
       asm_invlpg(virt);
+    else if (CPU_CHECK(CPU_FEAT_INVPCID))
+      invpcid(0, pcid, virt);
+    break;
+
+  case INVL_SINGLE_ASID:
+    // Sample the generation before flushing, since anything that changes
+    // after that might not have been flushed
+    gen = ATOMIC_READ(&spc->tlb_gen);
+    if (CPU_CHECK(CPU_FEAT_INVPCID))
+      invpcid(1, pcid, 0);
+    else if (loaded)
+      asm_write_cr3(cr3 & ~(1ull << 63));  // Without the no-flush bit
+    else
       break;
 
-    case INVL_ENTIRE_TLB:
-      asm_write_cr4(asm_read_cr4() & ~(1 << 7));
-      asm_write_cr4(asm_read_cr4() | (1 << 7));
-      __asm__ volatile ("wbinvd" ::: "memory");
-      break;
+    // Everything this CPU had cached for the space is gone now
+    if (pcid > 0)
+      this_cpu->asid_slots[pcid - 1].tlb_gen = gen;
+    break;
 
-    default:
-      klog("hat: Invalidation mode %d is not supported!", mode);
+  case INVL_ALL_ASIDS:
+    if (CPU_CHECK(CPU_FEAT_INVPCID)) {
+      invpcid(3, 0, 0);
+      break;
     }
+
+    // fallthrough
+  case INVL_ENTIRE_TLB:
+    // Toggling CR4.PGE drops every entry, including global ones
+    asm_write_cr4(asm_read_cr4() & ~(1 << 7));
+    asm_write_cr4(asm_read_cr4() | (1 << 7));
+    break;
+
+  default:
+    klog("hat: Invalidation mode %d is not supported!", mode);
   }
+}
+
+void hat_invl_done(vm_space_t* spc, uint64_t gen) {
+  struct percpu_info* cpu = this_cpu_or_null;
+  if (cpu == NULL || spc == &kernel_space)
+    return;
 
-  spinrelease(&hat_lock);
+  // Spaces that aren't loaded could only be flushed by address with INVPCID
+  bool loaded = ((asm_read_cr3() & PTE_ADDR_MASK) == spc->root);
+  int pcid = find_asid(spc);
+  if (pcid > 0 && (loaded || CPU_CHECK(CPU_FEAT_INVPCID)) &&
+      cpu->asid_slots[pcid - 1].tlb_gen == gen - 1)
+    cpu->asid_slots[pcid - 1].tlb_gen = gen;
+
+  if (loaded && cpu->cur_spc == spc && cpu->loaded_gen == gen - 1)
+    cpu->loaded_gen = gen;
 }
 
-void hat_scrub_pde(uintptr_t root, int level) {
-  uintptr_t virt = root + VM_MEM_OFFSET;
-  uint64_t* pde = (uint64_t*)virt;
+// Frees every table below 'table', zeroing the entries as it goes so that
+// the tables can be cached
+static void scrub_level(vm_space_t* spc,
+                        uintptr_t table,
+                        int level,
+                        uintptr_t* list) {
+  uint64_t* pde = (uint64_t*)(table + VM_MEM_OFFSET);
+
+  // Only the lower half of the top level belongs to the user
+  size_t entries = (level == cur_config->levels) ? 256 : 512;
+
+  for (size_t i = 0; i < entries; i++) {
+    if (!(pde[i] & 1) || (pde[i] & (1 << 7))) {
+      pde[i] = 0;
+      continue;
+    }
 
-  if (level >= 3) {
-    for (size_t i = 0; i < 256; i++)
-      if (pde[i] & 1)
-        hat_scrub_pde((pde[i] & ~(0x1ff)), level - 1);
-      else if (pde[i] & 7)
-        vm_phys_free((void*)(pde[i] & ~(0x1ff)), 1);
-  } else {
-    for (size_t i = 0; i < 256; i++)
-      if (pde[i] & 1)
-        vm_phys_free((void*)(pde[i] & ~(0x1ff)), 1);
+    uintptr_t next = pde[i] & PTE_ADDR_MASK;
+    if (level > 2) {
+      scrub_level(spc, next, level - 1, list);
+      queue_pt(list, next, true);
+    } else if (!(pde[i] & PDE_SHARED) || put_shared_pt(next)) {
+      queue_pt(list, next, false);
+    }
+
+    ATOMIC_DEC(&spc->pt_pages);
+    pde[i] = 0;
   }
+}
 
-  vm_phys_free((void*)root, 1);
+// Only called once every CPU got off the space (see vm_space_destroy), and
+// CPUs that still have it cached under a PCID flush that on reuse, so the
+// tables can go right away
+void hat_scrub_pde(vm_space_t* spc) {
+  uintptr_t list = 0;
+  scrub_level(spc, spc->root, cur_config->levels, &list);
+
+  // The root still holds the kernel's half, so it isn't cached
+  hat_release_pts(list);
+  vm_phys_free((void*)spc->root, 1);
 }
 
 // The following VM function is placed here because
 // it does arch-specifc things, and I don't feel like
 // doing a '#ifdef __x86_64__'...
+//
+// Each CPU hands out a small set of PCIDs to the spaces it ran most recently
+// (PCID 0 is left for the kernel space), so switching between them never
+// flushes the TLB. Instead of tracking which idle PCIDs hold stale entries, each
+// space counts its flushes in 'tlb_gen', and a CPU only flushes the PCID on
+// load if it hasn't seen the latest generation (or the PCID was recycled).
 void vm_space_load(vm_space_t* s) {
+  struct percpu_info* cpu = this_cpu_or_null;
   uint64_t cr3 = s->root;
-  if (CPU_CHECK(CPU_FEAT_PCID)) {
-    cr3 |= (uint16_t)s->asid | (1ull << 63);
+
+  // Join the space's CPU mask before sampling its generation, so that any
+  // shootdown we can't see the result of is sure to reach us
+  if (cpu && cpu->cur_spc != s) {
+    track_space(cpu->cur_spc, cpu->proc_id, false);
+    track_space(s, cpu->proc_id, true);
+  }
+
+  uint64_t gen = ATOMIC_READ(&s->tlb_gen);
+  if (CPU_CHECK(CPU_FEAT_PCID) && s != &kernel_space) {
+    bool flush = false;
+
+    int pcid = find_asid(s);
+    if (pcid < 0) {
+      pcid = this_cpu->next_asid + 1;
+      this_cpu->next_asid = (this_cpu->next_asid + 1) % HAT_NR_ASIDS;
+      this_cpu->asid_slots[pcid - 1].ctx_id = s->ctx_id;
+      flush = true;
+    } else if (this_cpu->asid_slots[pcid - 1].tlb_gen != gen) {
+      flush = true;
+    }
+
+    this_cpu->asid_slots[pcid - 1].tlb_gen = gen;
+    cr3 |= pcid | (flush ? 0 : (1ull << 63));
+  } else if (CPU_CHECK(CPU_FEAT_PCID)) {
+    // The kernel space has no user mappings that could go stale
+    cr3 |= (1ull << 63);
   }
 
   asm_write_cr3(cr3);
-  s->active = true;
+  if (cpu) {
+    cpu->cur_spc = s;
+    cpu->loaded_gen = gen;
+  }
+}
+
+// Kernel threads and the idle loop never touch user memory, so they keep
+// running on whatever space was loaded before them (lazy TLB). This means a
+// user space can stay in CR3 well after its threads stop running here, so
+// every CPU with it loaded is tracked in 'cpus', and brought up to date by
+// a shootdown IPI whenever the space is flushed or destroyed.
+void hat_sync_tlb() {
+  struct percpu_info* cpu = this_cpu;
+  vm_space_t* spc = cpu->cur_spc;
+  cpu->tlb_pending = false;
+
+  if (spc == &kernel_space)
+    return;
+
+  // Dying spaces are about to lose their page tables, so get off them
+  if (!ATOMIC_READ(&spc->active)) {
+    vm_space_load(&kernel_space);
+    return;
+  }
+
+  uint64_t gen = ATOMIC_READ(&spc->tlb_gen);
+  if (cpu->loaded_gen >= gen)
+    return;
+
+  hat_invl(spc, 0, INVL_SINGLE_ASID);
+  asm volatile("" ::: "memory");
+  cpu->loaded_gen = gen;
+}
+
+void hat_sync_pending() {
+  struct percpu_info* cpu = this_cpu_or_null;
+  if (cpu != NULL && ATOMIC_READ(&cpu->tlb_pending))
+    hat_sync_tlb();
+}
+
+void hat_shootdown(vm_space_t* spc) {
+  uint64_t gen = ATOMIC_READ(&spc->tlb_gen);
+  uint16_t self = this_cpu->proc_id;
+
+  for (int i = 0; i < VM_MAX_CPUS; i++) {
+    if (i == self || !(ATOMIC_READ(&spc->cpus[i / 64]) & (1ull << (i % 64))))
+      continue;
+
+    cpu_locals[i]->tlb_pending = true;
+    ic_send_ipi(IPI_INVL_TLB, cpu_locals[i]->lapic_id, IPI_SPECIFIC);
+  }
+
+  // Wait for everyone to catch up (or switch away). Keep serving our own
+  // requests meanwhile, in case the other side is waiting on us.
+  for (int i = 0; i < VM_MAX_CPUS; i++) {
+    if (i == self || cpu_locals[i] == NULL)
+      continue;
+
+    struct percpu_info* cpu = cpu_locals[i];
+    while (cpu->cur_spc == spc &&
+           (!ATOMIC_READ(&spc->active) || cpu->loaded_gen < gen)) {
+      hat_sync_pending();
+      asm volatile("pause" ::: "memory");
+    }
+  }
 }
 
 void handle_pf(cpu_ctx_t* context) {
@@ -253,8 +868,16 @@ void handle_pf(cpu_ctx_t* context) {
 
   // Call the kernel page fault handler, and
   // make sure the page fault was fixed
-  if (!vm_fault(address, vf))
+  if (!vm_fault(address, vf)) {
+    // Faults on usermode pointers from the copy routines are recoverable
+    uintptr_t fixup = (context->cs & 3) ? 0 : mg_find_fixup(context->rip);
+    if (fixup) {
+      context->rip = fixup;
+      return;
+    }
+
     do_panic = true; // PANIC for now, since we can't send signals/kill threads
+  }
 
   // For more information on the bits of the error code,
   // see Intel x86_64 SDM Volume 3a Chapter 4.7
@@ -278,9 +901,13 @@ void handle_pf(cpu_ctx_t* context) {
       PANIC(context, NULL);
   }
 
-  // Now that the page fault is successfully handled, switch GS back
-  if (context->cs & 3)
+  // Now that the page fault is successfully handled, switch GS back (after
+  // loading the FPU, in case the fault blocked and another thread ran)
+  if (context->cs & 3) {
+    asm_disable_intr();
+    fpu_return_to_user();
     asm_swapgs();
+  }
 }
 
 // Bootstraps the HAT...
@@ -134,6 +134,13 @@ global sched_spinup
 sched_spinup:
   mov rsp, rdi
 
+  ; We're off the old thread's stack, so let other CPUs run it (if asked to)
+  test rsi, rsi
+  jz .restore
+  mov byte [rsi], 0
+
+.restore:
+
   asm_pop_regs
   add rsp, 16  ; Pop the CPU pushed error code and int-no
 
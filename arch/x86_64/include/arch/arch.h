@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <lib/types.h>
 
 void arch_early_init();
 void arch_init();
@@ -12,7 +13,12 @@ void arch_init();
 void mg_enable();
 void mg_disable();
 bool mg_validate(uintptr_t ptr, size_t len);
-bool mg_copy_to_user(void* usrptr, void* srcptr, size_t len);
-bool mg_copy_from_user(void* kernptr, void* srcptr, size_t len);
+uintptr_t mg_find_fixup(uintptr_t rip);
+
+// Usermode copy routines, which fail (instead of faulting) on bad pointers
+bool copy_to_user(void* usrptr, const void* kernptr, size_t len);
+bool copy_from_user(void* kernptr, const void* usrptr, size_t len);
+bool clear_user(void* usrptr, size_t len);
+ssize_t strncpy_from_user(char* kernptr, const char* usrptr, size_t len);
 
 #endif  // ARCH_ARCH_H
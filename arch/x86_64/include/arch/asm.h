@@ -21,6 +21,12 @@
 #define asm_invlpg(k) ({ asm volatile("invlpg %0" ::"m"(k) : "memory"); })
 #define asm_swapgs()  ({ asm volatile("swapgs" ::: "memory"); })
 
+// FSGSBASE routines (only usable when CR4.FSGSBASE is set)
+#define asm_rdfsbase() ({ uint64_t v; asm volatile("rdfsbase %0" : "=r"(v)); v; })
+#define asm_rdgsbase() ({ uint64_t v; asm volatile("rdgsbase %0" : "=r"(v)); v; })
+#define asm_wrfsbase(v) ({ asm volatile("wrfsbase %0" ::"r"((uint64_t)(v))); })
+#define asm_wrgsbase(v) ({ asm volatile("wrgsbase %0" ::"r"((uint64_t)(v))); })
+
 // CR0-4 & MSR asm routines
 #define ASM_MAKE_CRN(N)                                                        \
   static inline uint64_t asm_read_cr##N(void)                                  \
@@ -13,6 +13,10 @@
 #define CPU_FEAT_SMAP      (1 << 5)
 #define CPU_FEAT_TCE       (1 << 6)
 #define CPU_FEAT_XSAVE     (1 << 7)
+#define CPU_FEAT_PAGE1GB   (1 << 8)
+#define CPU_FEAT_ERMS      (1 << 9)
+#define CPU_FEAT_FSRM      (1 << 10)
+#define CPU_FEAT_FSGSBASE  (1 << 11)
 #define CPU_CHECK(k) (cpu_features & k)
 extern uint64_t cpu_features;
 
@@ -24,12 +28,14 @@ void calibrate_tsc();
 extern uint64_t fpu_save_size;
 void fpu_save(uint8_t* zone);    // Must be 16 or 64-byte aligned
 void fpu_restore(uint8_t* zone);
+void fpu_return_to_user();
 
 // Proc related functions
 void cpu_create_kctx(thread_t* thrd, uintptr_t entry, uint64_t arg1);
 void cpu_create_uctx(thread_t* thrd, struct exec_args args, bool elf);
+void cpu_destroy_ctx(thread_t* thrd);
 void cpu_save_thread(cpu_ctx_t* context);
-void cpu_restore_thread(cpu_ctx_t* context);
+void cpu_restore_thread(cpu_ctx_t* context, thread_t* prev);
 
 // Tell if we're BSP
 static inline bool is_bsp() {
@@ -74,6 +74,8 @@
 #define CPUID_EBX_SMEP (1U << 7U)
 /* CPUID.07H:EBX.MPX */
 #define CPUID_EBX_MPX (1U << 14U)
+/* CPUID.07H:EBX.ERMS */
+#define CPUID_EBX_ERMS (1U << 9U)
 /* CPUID.07H:EBX.SMAP*/
 #define CPUID_EBX_SMAP (1U << 20U)
 /* CPUID.07H:ECX.UMIP */
@@ -90,6 +92,8 @@
 #define CPUID_ECX_SGX_LC (1U << 30U)
 /* CPUID.07H:ECX.PKS*/
 #define CPUID_ECX_PKS (1U << 31U)
+/* CPUID.07H:EDX.FSRM */
+#define CPUID_EDX_FSRM (1U << 4U)
 /* CPUID.07H:EDX.CET_IBT */
 #define CPUID_EDX_CET_IBT (1U << 20U)
 /* CPUID.07H:EDX.IBRS_IBPB*/
@@ -110,6 +114,8 @@
 #define CPUID_EBX_AVX512 (1U << 16U)
 /* CPUID.01H:ECX.PCID*/
 #define CPUID_ECX_PCID (1U << 17U)
+/* CPUID.0DH.EAX.XSAVEOPT */
+#define CPUID_EAX_XSAVEOPT (1U << 0U)
 /* CPUID.0DH.EAX.XSAVEC */
 #define CPUID_EAX_XSAVEC (1U << 1U)
 /* CPUID.0DH.EAX.XCR0_BNDREGS */
@@ -10,21 +10,92 @@
 // be called by the VM...
 
 uint64_t hat_create_pte(vm_flags_t flags, uintptr_t phys, bool is_block);
-void hat_scrub_pde(uintptr_t root, int level);
+static inline bool hat_pte_present(uint64_t pte) {
+  return (pte & 1);
+}
+void hat_scrub_pde(vm_space_t* spc);
+
+// Number of PCIDs each CPU hands out to recently used spaces
+#define HAT_NR_ASIDS 6
+
+// Number of zeroed page table pages each CPU keeps around
+#define HAT_PT_CACHE 64
 
 #define INVL_SINGLE_ADDR 0x10
 #define INVL_SINGLE_ASID 0x11
 #define INVL_ALL_ASIDS   0x13
 #define INVL_ENTIRE_TLB  0x12
-void hat_invl(uintptr_t root, uintptr_t virt, uint32_t asid, int mode);
+void hat_invl(vm_space_t* spc, uintptr_t virt, int mode);
+
+// Called once this CPU has flushed every address that changed in generation
+// 'gen' of 'spc' one by one. If it had seen everything before that, its
+// cached copy of the space is up to date, and won't be flushed on load.
+void hat_invl_done(vm_space_t* spc, uint64_t gen);
+
+// Makes every other CPU that has 'spc' loaded catch up with its TLB
+// generation, waiting until they have done so
+void hat_shootdown(vm_space_t* spc);
+void hat_sync_tlb();
+
+// Serves a shootdown aimed at this CPU, if there is one, which anything that
+// spins with interrupts disabled has to keep doing
+void hat_sync_pending();
+
+// Leaf tables shared with another space (see hat_share_range) are only
+// copied for callers that ask for it, which they have to whenever the PTE
+// they're about to write wouldn't be right for every space sharing it
+#define TRANSLATE_CREATE  (1 << 0)  // Create missing tables on the way down
+#define TRANSLATE_UNSHARE (1 << 1)  // Take a private copy of a shared table
 
 #define TRANSLATE_DEPTH_NORM 0xE1
 #define TRANSLATE_DEPTH_HUGE 0xE2
-uint64_t* hat_translate_addr(uintptr_t root,
+uint64_t* hat_translate_addr(vm_space_t* spc,
                              uintptr_t virt,
-                             bool create,
+                             int flags,
                              int depth);
 
+// Shares the leaf page tables covering [virt, virt + len) between two roots,
+// write-protecting them until one side modifies its copy
+void hat_share_range(vm_space_t* src,
+                     vm_space_t* dest,
+                     uintptr_t virt,
+                     size_t len);
+
+// Single-pass operations on every page in [virt, virt + len), which only
+// walk down from the root once. Unmapping frees any tables left empty,
+// protecting never grants write access to a page that didn't already have
+// it, and querying calls 'fn' on every present page (4KB and huge ones).
+// Unmapping returns how many (base sized) pages were actually present, and
+// hands back the tables it freed through 'freed' (see hat_release_pts).
+typedef void (*hat_query_fn)(uintptr_t virt,
+                             uintptr_t phys,
+                             size_t size,
+                             void* arg);
+void hat_map_range(vm_space_t* spc,
+                   uintptr_t phys,
+                   uintptr_t virt,
+                   size_t len,
+                   vm_flags_t flags);
+size_t hat_unmap_range(vm_space_t* spc,
+                       uintptr_t virt,
+                       size_t len,
+                       uintptr_t* freed);
+
+// Returns a list of zeroed tables (linked through their first entry) to the
+// cache in one go, freeing whatever doesn't fit. Other CPUs may keep walking
+// the tables through their paging-structure caches, so this has to wait until
+// after the TLB shootdown for the range they were unmapped from.
+void hat_release_pts(uintptr_t list);
+void hat_protect_range(vm_space_t* spc,
+                       uintptr_t virt,
+                       size_t len,
+                       vm_flags_t flags);
+void hat_query_range(vm_space_t* spc,
+                     uintptr_t virt,
+                     size_t len,
+                     hat_query_fn fn,
+                     void* arg);
+
 // Passes pagefaults to the VM, after some inspection
 void handle_pf(cpu_ctx_t* context);
 
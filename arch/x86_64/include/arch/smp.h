@@ -2,27 +2,91 @@
 #define ARCH_SMP_H
 
 #include <arch/cpu.h>
+#include <arch/hat.h>
 #include <arch/tables.h>
 #include <ninex/proc.h>
 #include <vm/virt.h>
 #include <arch/asm.h>
+#include <stddef.h>
 
 struct percpu_info {
+  // Points back at this struct, so that finding it only takes a load from
+  // GS (see this_cpu). The fields after it are used by syscall.asm and
+  // set_errno, so they can't be moved around either.
+  struct percpu_info* self;
+  uintptr_t kernel_stack, user_stack;
+  uint32_t errno;
+
   uint32_t lapic_id;
   uint16_t proc_id;
   uint64_t tsc_freq, lapic_freq;
-  uintptr_t kernel_stack, user_stack;
   thread_t* cur_thread;
   vm_space_t* cur_spc;
-  uint32_t errno;
   struct tss tss;
   bool yielded;
+
+  // Spaces that own a PCID on this CPU, along with the TLB generation that
+  // was last flushed into it (see vm_space_load)
+  struct {
+    uint64_t ctx_id, tlb_gen;
+  } asid_slots[HAT_NR_ASIDS];
+  uint32_t next_asid;
+
+  // TLB generation of 'cur_spc' that this CPU has caught up with, and
+  // whether another CPU asked us to catch up again (see hat_shootdown)
+  uint64_t loaded_gen;
+  bool tlb_pending;
+
+  // Zeroed pages for new page tables (see alloc_pt)
+  uintptr_t pt_cache[HAT_PT_CACHE];
+  uint32_t pt_cached;
+
+  // Thread whose FPU state is in this CPU's registers (see fpu_return_to_user)
+  thread_t* fpu_owner;
 } __attribute__((packed));
 
+_Static_assert(offsetof(struct percpu_info, self) == 0, "see this_cpu");
+_Static_assert(offsetof(struct percpu_info, kernel_stack) == 8 &&
+                   offsetof(struct percpu_info, user_stack) == 16 &&
+                   offsetof(struct percpu_info, errno) == 24,
+               "see syscall.asm and set_errno");
+
 void smp_startup();
+extern struct percpu_info* cpu_locals[VM_MAX_CPUS];
+extern bool percpu_ready;
+
+// Macros for accessing the percpu_info struct, where this_cpu_read and
+// this_cpu_write are single GS-relative instructions, that can't be torn
+// by the thread moving to another CPU halfway through. The compiler can't
+// tell that they touch the same memory as this_cpu->field, so both clobber
+// memory to stay ordered with accesses made through this_cpu.
+#define this_cpu                                  \
+  ({                                              \
+    struct percpu_info* __cpu;                    \
+    asm volatile("mov %%gs:0, %0" : "=r"(__cpu)); \
+    __cpu;                                        \
+  })
+#define this_cpu_read(field)                                  \
+  ({                                                          \
+    typeof(((struct percpu_info*)0)->field) __val;            \
+    asm volatile("mov %%gs:%c1, %0"                           \
+                 : "=r"(__val)                                \
+                 : "i"(offsetof(struct percpu_info, field))   \
+                 : "memory");                                 \
+    __val;                                                    \
+  })
+#define this_cpu_write(field, val)                                      \
+  ({                                                                    \
+    typeof(((struct percpu_info*)0)->field) __val = (val);              \
+    asm volatile("mov %0, %%gs:%c1"                                     \
+                 :                                                      \
+                 : "r"(__val), "i"(offsetof(struct percpu_info, field)) \
+                 : "memory");                                           \
+  })
+
+// Same as this_cpu, but for code that can run before GS is setup on the BSP
+#define this_cpu_or_null (percpu_ready ? this_cpu : NULL)
 
-// Macro for accessing the percpu_info struct
-#define this_cpu ((struct percpu_info*)asm_rdmsr(IA32_GS_BASE))
 #define cpu_num                                                    \
   ({                                                               \
     int ret;                                                       \
@@ -35,4 +99,22 @@ void smp_startup();
     ret;                                                           \
   })
 
+// Per-CPU variables are put into the '.percpu' section, which only serves as
+// a template, since every CPU gets its own copy of it, right after its
+// percpu_info (see smp_startup).
+extern char __percpu_start[], __percpu_end[];
+
+#define PERCPU_INFO_SIZE ((sizeof(struct percpu_info) + 63) & ~63UL)
+#define PERCPU_AREA_SIZE \
+  (PERCPU_INFO_SIZE + (size_t)(__percpu_end - __percpu_start))
+
+#define DEFINE_PERCPU(type, name) \
+  __attribute__((section(".percpu"))) type name
+#define percpu_offset(var) \
+  (PERCPU_INFO_SIZE + ((uintptr_t)&(var) - (uintptr_t)__percpu_start))
+#define per_cpu_ptr(var, cpu) \
+  ((typeof(&(var)))((uintptr_t)cpu_locals[cpu] + percpu_offset(var)))
+#define this_cpu_ptr(var) \
+  ((typeof(&(var)))((uintptr_t)this_cpu + percpu_offset(var)))
+
 #endif  // ARCH_SMP_H
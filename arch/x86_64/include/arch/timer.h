@@ -31,6 +31,7 @@ typedef struct acpi_hpet_t {
 void timer_cali();
 void timer_usleep(uint64_t us);
 void timer_msleep(uint64_t ms);
+uint64_t timer_get_ns();  // Monotonic clock, in nanoseconds
 
 // On x86, timer related stuff is done in the APIC, so define it as such
 #define timer_oneshot(ms, slot) ic_timer_oneshot(ms, slot)
@@ -12,6 +12,8 @@
 extern vec_t(madt_lapic_t*) madt_lapics;
 static _Atomic(int) online_cores = 0;
 static lock_t smp_lock;
+struct percpu_info* cpu_locals[VM_MAX_CPUS];
+bool percpu_ready = false;
 
 // Include the compiled smp trampoline
 extern uint64_t smp_bootcode_begin[];
@@ -74,8 +76,12 @@ void smp_startup() {
   for (int i = 0; i < madt_lapics.length; i++) {
     madt_lapic_t* cur_lapic = madt_lapics.data[i];
 
-    // Create the CPU local information (stored in GS)
-    struct percpu_info* percpu = kmalloc(sizeof(struct percpu_info));
+    // Create the CPU local information (stored in GS), followed by this
+    // CPU's copy of the per-CPU variables
+    struct percpu_info* percpu = kmalloc(PERCPU_AREA_SIZE);
+    memcpy((void*)((uintptr_t)percpu + PERCPU_INFO_SIZE), __percpu_start,
+           __percpu_end - __percpu_start);
+    percpu->self = percpu;
     percpu->lapic_id = cur_lapic->apic_id;
     percpu->proc_id = cur_lapic->processor_id;
     percpu->cur_spc = &kernel_space;
@@ -84,6 +90,7 @@ void smp_startup() {
     percpu->tss.rsp0 = percpu->kernel_stack;
     percpu->tss.ist1 = (uint64_t)vm_phys_alloc(16, VM_ALLOC_ZERO) +
                        VM_MEM_OFFSET + (VM_PAGE_SIZE * 16);
+    cpu_locals[percpu->proc_id] = percpu;
 
     if (!(cur_lapic->flags & 1)) {
       klog("smp: CPU core %d is disabled!", cur_lapic->processor_id);
@@ -92,6 +99,7 @@ void smp_startup() {
     } else if (cur_lapic->apic_id == get_lapic_id()) {
       asm_wrmsr(IA32_GS_BASE, (uint64_t)percpu);
       asm_wrmsr(IA32_TSC_AUX, cur_lapic->processor_id);
+      percpu_ready = true;
       load_tss((uintptr_t)&percpu->tss);
       continue;
     }
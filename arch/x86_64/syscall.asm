@@ -5,6 +5,14 @@ section .text
 extern syscall_table
 extern nr_syscalls
 
+; Defined in arch/x86_64/cpu.c
+extern fpu_return_to_user
+
+; Offsets into 'struct percpu_info' (see arch/x86_64/include/arch/smp.h)
+%define PERCPU_KERNEL_STACK 8
+%define PERCPU_USER_STACK   16
+%define PERCPU_ERRNO        24
+
 ; The syscall instruction starts off here
 global asm_syscall_entry
 asm_syscall_entry:
@@ -14,13 +22,13 @@ asm_syscall_entry:
 
   ; Next, swap stacks and GSBASE, before pushing a stack frame
   swapgs
-  mov [gs:30], rsp       ; gs.user_stack = rsp
-  mov rsp, [gs:22]       ; rsp = gs.kernel_stack
+  mov [gs:PERCPU_USER_STACK], rsp    ; gs.user_stack = rsp
+  mov rsp, [gs:PERCPU_KERNEL_STACK]  ; rsp = gs.kernel_stack
   sti
 
   ; Create a dummy interrupt frame
   push qword 0x38         ; user data segment
-  push qword [gs:30]      ; saved stack
+  push qword [gs:PERCPU_USER_STACK]  ; saved stack
   push r11                ; saved rflags
   push qword 0x40         ; user code segment
   push rcx                ; instruction pointer
@@ -49,6 +57,11 @@ asm_syscall_entry:
   lea rbx, [rel syscall_table]
   call [rbx + rax * 8]
 
+  ; Disable interrupts, before loading the FPU state (if the syscall blocked
+  ; and another thread used the FPU) and restoring the remaining context
+  cli
+  call fpu_return_to_user
+
   ; Pop the registers, and clean the remaining mess
   pop r15
   pop r14
@@ -67,11 +80,9 @@ asm_syscall_entry:
   pop rax
   add rsp, 56
 
-  ; Disable interrupts, before restoring the remaining context
-  cli
-  mov rax, qword [gs:54]  ; rax = gs.errno
-  mov rsp, qword [gs:30]  ; rsp = gs.user_stack
-  mov qword [gs:54], 0    ; clear errno
+  mov eax, dword [gs:PERCPU_ERRNO]       ; rax = gs.errno
+  mov rsp, qword [gs:PERCPU_USER_STACK]  ; rsp = gs.user_stack
+  mov dword [gs:PERCPU_ERRNO], 0         ; clear errno
   swapgs
   o64 sysret
 
@@ -1,3 +1,4 @@
+#include <arch/arch.h>
 #include <arch/asm.h>
 #include <arch/hat.h>
 #include <arch/smp.h>
@@ -183,11 +184,22 @@ cpu_ctx_t* sys_dispatch_isr(cpu_ctx_t* context) {
 
   if (vec == 14) {
     handle_pf(context);
+  } else if (vec == 13 && !(context->cs & 3) && mg_find_fixup(context->rip)) {
+    // Non-canonical usermode pointers #GP instead of #PF
+    context->rip = mg_find_fixup(context->rip);
   } else if (vec < 32) {
     PANIC(context, NULL);
-  } else if (vec == resched_slot) {
+  } else if (vec == (uint32_t)resched_slot || vec == IPI_SCHED_YIELD) {
     ic_eoi();
     reschedule(context);
+  } else if (vec == SOFTINT_SCHED_YIELD) {
+    reschedule(context);
+  } else if (vec == IPI_INVL_TLB) {
+    // Shootdowns can land in usermode, where GS isn't ours yet
+    if (context->cs & 3) asm_swapgs();
+    ic_eoi();
+    hat_sync_tlb();
+    if (context->cs & 3) asm_swapgs();
   } else {
     respond_irq(context, vec);
   }
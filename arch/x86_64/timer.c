@@ -4,6 +4,7 @@
 #include <lib/kcon.h>
 #include <lib/lock.h>
 #include <ninex/acpi.h>
+#include <vm/virt.h>
 #include <vm/vm.h>
 
 #define HPET_REG_CAP 0x0
@@ -22,16 +23,13 @@ static inline void hpet_write(uint16_t reg, uint64_t val) {
   *((volatile uint64_t*)(hpet_base + reg)) = val;
 }
 
-void hpet_sleep(uint64_t ms) {
+static void hpet_init() {
   if (hpet_base == NULL) {
     acpi_hpet_t* h = acpi_query("HPET", 0);
     if (h == NULL)
       PANIC(NULL, "Unable to find HPET on this system!\n");
 
-    // NOTE: Once again, it is the responsibility of the
-    // loader/firmware to map the HPET into memory, with
-    // the proper permissions/attributes
-    hpet_base = (void*)(h->base.base + VM_MEM_OFFSET);
+    hpet_base = vm_map_mmio(h->base.base, 0x1000, VM_CACHE_UNCACHED);
 
     // Make sure the HPET isn't bogus
     uint32_t reg_count = ((hpet_read(HPET_REG_CAP) >> 8) & 0x1F) + 1;
@@ -43,6 +41,10 @@ void hpet_sleep(uint64_t ms) {
     hpet_write(HPET_REG_COUNTER, 0);
     hpet_write(HPET_REG_CONF, hpet_read(HPET_REG_CONF) | (1 << 0));
   }
+}
+
+void hpet_sleep(uint64_t ms) {
+  hpet_init();
 
   uint64_t goal =
       hpet_read(HPET_REG_COUNTER) + (ms * (1000000000000 / hpet_period));
@@ -134,8 +136,9 @@ check_cpu_speed:
 }
 
 void timer_usleep(uint64_t us) {
-  if (CPU_CHECK(CPU_FEAT_INVARIANT) && this_cpu->tsc_freq) {
-    uint64_t goal = asm_rdtsc() + (us * (this_cpu->tsc_freq / 1000));
+  uint64_t freq = this_cpu_read(tsc_freq);
+  if (CPU_CHECK(CPU_FEAT_INVARIANT) && freq) {
+    uint64_t goal = asm_rdtsc() + (us * (freq / 1000));
 
     while (asm_rdtsc() < goal)
       asm("pause");
@@ -146,8 +149,9 @@ void timer_usleep(uint64_t us) {
 }
 
 void timer_msleep(uint64_t ms) {
-  if (CPU_CHECK(CPU_FEAT_INVARIANT) && this_cpu->tsc_freq) {
-    uint64_t goal = asm_rdtsc() + (ms * this_cpu->tsc_freq);
+  uint64_t freq = this_cpu_read(tsc_freq);
+  if (CPU_CHECK(CPU_FEAT_INVARIANT) && freq) {
+    uint64_t goal = asm_rdtsc() + (ms * freq);
 
     while (asm_rdtsc() < goal)
       asm("pause");
@@ -156,3 +160,19 @@ void timer_msleep(uint64_t ms) {
   }
 }
 
+
+uint64_t timer_get_ns() {
+  // Both conversions are split up, since multiplying the raw counter
+  // would overflow after a few hours of uptime
+  uint64_t freq = this_cpu_read(tsc_freq);
+  if (CPU_CHECK(CPU_FEAT_INVARIANT) && freq) {
+    uint64_t tsc = asm_rdtsc();
+    return (tsc / freq) * 1000000 + ((tsc % freq) * 1000000) / freq;
+  } else {
+    // The HPET's period is in femtoseconds
+    hpet_init();
+    uint64_t ticks = hpet_read(HPET_REG_COUNTER);
+    return (ticks / 1000000) * hpet_period +
+           ((ticks % 1000000) * hpet_period) / 1000000;
+  }
+}
@@ -0,0 +1,90 @@
+[bits 64]
+
+; Every instruction in here that touches usermode memory gets an entry in the
+; exception table, so that a fault on it resumes at the fixup (see mg_find_fixup)
+section .ex_table alloc noexec nowrite progbits align=8
+
+%macro EX_ENTRY 2
+[section .ex_table]
+  dq %1, %2
+__SECT__
+%endmacro
+
+section .text
+
+; size_t asm_copy_user_erms(void* dest, const void* src, size_t len)
+;
+; Copies using a single 'rep movsb', which is the fastest option on CPUs that
+; advertise ERMS/FSRM. Returns the amount of bytes that were left uncopied.
+global asm_copy_user_erms
+asm_copy_user_erms:
+  mov rcx, rdx
+.copy:
+  rep movsb
+  xor eax, eax
+  ret
+.fault:
+  mov rax, rcx
+  ret
+EX_ENTRY .copy, .fault
+
+; size_t asm_copy_user_slow(void* dest, const void* src, size_t len)
+;
+; Fallback for older CPUs, which copies in qwords before finishing off the tail
+global asm_copy_user_slow
+asm_copy_user_slow:
+  mov rcx, rdx
+  shr rcx, 3
+  and edx, 7
+.copy_qwords:
+  rep movsq
+  mov rcx, rdx
+.copy_bytes:
+  rep movsb
+  xor eax, eax
+  ret
+.qword_fault:
+  lea rax, [rdx + rcx * 8]
+  ret
+.byte_fault:
+  mov rax, rcx
+  ret
+EX_ENTRY .copy_qwords, .qword_fault
+EX_ENTRY .copy_bytes, .byte_fault
+
+; size_t asm_clear_user(void* dest, size_t len)
+global asm_clear_user
+asm_clear_user:
+  mov rcx, rsi
+  xor eax, eax
+.zero:
+  rep stosb
+  ret
+.fault:
+  mov rax, rcx
+  ret
+EX_ENTRY .zero, .fault
+
+; ssize_t asm_strncpy_user(char* dest, const char* src, size_t len)
+;
+; Returns the length of the copied string, 'len' if no NUL terminator was
+; found (in which case 'dest' isn't terminated) or -1 on a fault
+global asm_strncpy_user
+asm_strncpy_user:
+  xor eax, eax
+.next:
+  cmp rax, rdx
+  je .done
+.load:
+  mov cl, [rsi + rax]
+  mov [rdi + rax], cl
+  test cl, cl
+  jz .done
+  inc rax
+  jmp .next
+.done:
+  ret
+.fault:
+  mov rax, -1
+  ret
+EX_ENTRY .load, .fault
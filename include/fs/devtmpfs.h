@@ -21,5 +21,6 @@ size_t devtmpfs_create_id(int subclass);
 
 void setup_unix_streams();
 void setup_random_streams();
+void setup_vmstat_stream();
 
 #endif  // FS_DEVTMPFS_H
@@ -86,6 +86,7 @@ struct dirent {
 /*
  * 9x internal definitions
  */
+struct vm_cache;
 struct vnode {
   ssize_t (*read)(struct vnode *, void *, off_t, size_t);
   ssize_t (*write)(struct vnode *, const void *, off_t, size_t);
@@ -96,6 +97,7 @@ struct vnode {
   struct stat st;
   lock_t lock;
   int64_t refcount;
+  struct vm_cache *cache;  // Pages of the file that have been mapped
 };
 
 struct handle {
@@ -60,6 +60,18 @@ uint64_t strtoll(const char *nptr, char **endptr, int base);
     typeof(B) _b_ = B;   \
     (_a_ / _b_) * _b_;   \
   })
+#define MIN(A, B)          \
+  ({                       \
+    typeof(A) _x_ = A;     \
+    typeof(B) _y_ = B;     \
+    _x_ < _y_ ? _x_ : _y_; \
+  })
+#define MAX(A, B)          \
+  ({                       \
+    typeof(A) _x_ = A;     \
+    typeof(B) _y_ = B;     \
+    _x_ > _y_ ? _x_ : _y_; \
+  })
 #define ARRAY_LEN(arr) (sizeof(arr) / sizeof(*arr))
 
 // Stack tracing functions
@@ -0,0 +1,28 @@
+#ifndef LIB_CPUMASK_H
+#define LIB_CPUMASK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vm/virt.h>
+
+// Set of CPUs, with a bit for each 'proc_id'
+typedef struct cpumask {
+  uint64_t bits[VM_MAX_CPUS / 64];
+} cpumask_t;
+
+#define cpumask_test(mask, cpu) \
+  (((mask)->bits[(cpu) / 64] >> ((cpu) % 64)) & 1)
+#define cpumask_set(mask, cpu) \
+  ((mask)->bits[(cpu) / 64] |= (1ull << ((cpu) % 64)))
+#define cpumask_clear(mask, cpu) \
+  ((mask)->bits[(cpu) / 64] &= ~(1ull << ((cpu) % 64)))
+
+static inline bool cpumask_empty(const cpumask_t *mask) {
+  for (size_t i = 0; i < VM_MAX_CPUS / 64; i++)
+    if (mask->bits[i] != 0) return false;
+
+  return true;
+}
+
+#endif  // LIB_CPUMASK_H
@@ -114,10 +114,10 @@
 #define ERESTART 1106
 #define EUSERS 1107
 
-// Arch-Specific function for setting errno
+// Arch-Specific function for setting errno (see 'struct percpu_info')
 #ifdef __x86_64__
 static __attribute__((always_inline)) void set_errno(uint32_t errno) {
-  asm("mov %0, %%gs:54" ::"r"(errno));
+  asm volatile("mov %0, %%gs:24" ::"r"(errno) : "memory");
 }
 #endif  // __x86_64__
 
@@ -16,5 +16,8 @@ void htab_insert(struct hash_table *htab,
                  size_t key_size,
                  void *data);
 void htab_delete(struct hash_table *htab, void *key, size_t key_size);
+void htab_clone(struct hash_table *dest,
+                struct hash_table *src,
+                size_t key_size);
 
 #endif  // LIB_HTAB_H
@@ -6,6 +6,8 @@
 #define ATOMIC_READ(j) __atomic_load_n(j, __ATOMIC_SEQ_CST)
 #define ATOMIC_WRITE(ptr, j) __atomic_store_n(ptr, j, __ATOMIC_SEQ_CST)
 #define ATOMIC_INC(i) __sync_add_and_fetch((i), 1)
+#define ATOMIC_DEC(i) __sync_sub_and_fetch((i), 1)
+#define ATOMIC_ADD(i, j) __sync_add_and_fetch((i), (j))
 #define ATOMIC_CAS(var, cond, write)                                     \
   __atomic_compare_exchange_n(var, cond, write, false, __ATOMIC_SEQ_CST, \
                               __ATOMIC_RELAXED)
@@ -18,18 +20,20 @@ typedef volatile int lock_t;
 #define trylock(x) __atomic_test_and_set(x, __ATOMIC_ACQUIRE)
 #define spinrelease(x) __atomic_clear(x, __ATOMIC_RELEASE)
 
-// Spinlocks, except they disable IRQs as well
-#define spinlock_irq(x)                                      \
-  ({                                                         \
-    if (asm_check_intr()) asm volatile("cli");               \
-                                                             \
-    while (__sync_lock_test_and_set(x, 1)) {                 \
-      if (asm_check_intr()) asm volatile("sti; pause; cli"); \
-      else                                                   \
-        asm volatile("pause");                               \
-    }                                                        \
-                                                             \
-    asm_check_intr();                                        \
+// Spinlocks, except they disable IRQs as well (returning whether they were
+// enabled beforehand, for spinrelease_irq)
+#define spinlock_irq(x)                           \
+  ({                                              \
+    bool __irq = asm_check_intr();                \
+    asm volatile("cli");                          \
+                                                  \
+    while (__sync_lock_test_and_set(x, 1)) {      \
+      if (__irq) asm volatile("sti; pause; cli"); \
+      else                                        \
+        asm volatile("pause");                    \
+    }                                             \
+                                                  \
+    __irq;                                        \
   })
 
 #define spinrelease_irq(x, irq)          \
@@ -0,0 +1,35 @@
+#ifndef LIB_RBTREE_H
+#define LIB_RBTREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Intrusive red-black tree, where the nodes are embedded into whatever
+// structure is being sorted (see rb_entry), so no allocations are needed
+struct rb_node {
+  struct rb_node *parent, *left, *right;
+  bool red;
+};
+
+struct rb_tree {
+  struct rb_node *root;
+  struct rb_node *leftmost;  // Cached, since it's what most users are after
+};
+
+// Returns true if 'a' should be sorted before 'b'
+typedef bool (*rb_less_t)(struct rb_node *a, struct rb_node *b);
+
+#define rb_entry(ptr, type, member) \
+  ((type *)((char *)(ptr)-offsetof(type, member)))
+
+#define rb_first(tree) ((tree)->leftmost)
+#define rb_empty(tree) ((tree)->root == NULL)
+
+void rb_insert(struct rb_tree *tree, struct rb_node *node, rb_less_t less);
+void rb_remove(struct rb_tree *tree, struct rb_node *node);
+
+struct rb_node *rb_last(struct rb_tree *tree);
+struct rb_node *rb_next(struct rb_node *node);
+struct rb_node *rb_prev(struct rb_node *node);
+
+#endif  // LIB_RBTREE_H
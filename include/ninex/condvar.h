@@ -4,7 +4,7 @@
 #include <lib/lock.h>
 #include <ninex/sched.h>
 
-typedef struct {
+typedef struct condvar {
   lock_t lock;
   struct threadlist waiters;
   size_t n_waiters;
@@ -21,4 +21,11 @@ typedef struct {
 void cv_wait(cv_t *condvar);
 void cv_signal(cv_t *condvar);
 
+// Waits until the condvar gets signalled, or timer_get_ns() reaches
+// 'deadline', in which case it returns false
+bool cv_timedwait(cv_t *condvar, uint64_t deadline);
+
+// Takes a thread off of whatever condvar it's waiting on, without waking it
+void cv_cancel_wait(thread_t *thread);
+
 #endif  // NINEX_CONDVAR_H
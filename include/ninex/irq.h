@@ -34,6 +34,10 @@ void respond_irq(cpu_ctx_t *context, int irq_num);
 #define IPI_INVL_TLB 253
 #define IPI_SCHED_YIELD 252
 
+// Raised by threads (with 'int') to switch away synchronously, which unlike
+// an IPI doesn't need an EOI (see sched_yield)
+#define SOFTINT_SCHED_YIELD 251
+
 // Macros that aid in dealing with IRQs
 #define disable_irq(i) get_irq_handler(i)->status |= IRQ_DISABLED;
 #define unmask_irq(i)                          \
@@ -0,0 +1,39 @@
+#ifndef NINEX_KTIMER_H
+#define NINEX_KTIMER_H
+
+#include <lib/queue.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// One-shot timer, which calls 'func' once timer_get_ns() reaches 'deadline'.
+// Timers go onto the wheel of the CPU that armed them, and their callbacks
+// run from that CPU's scheduler interrupt, with interrupts disabled.
+struct ktimer {
+  uint64_t deadline, tick;
+  void (*func)(struct ktimer *timer);
+  void *data;
+
+  // Wheel (and slot on it) that the timer was last armed on
+  struct timer_wheel *wheel;
+  uint8_t level, slot;
+  bool pending;
+  TAILQ_ENTRY(ktimer) link;
+};
+
+void ktimer_init(struct ktimer *timer,
+                 void (*func)(struct ktimer *timer),
+                 void *data);
+
+// Arms a timer that isn't pending already, on the current CPU
+void ktimer_arm(struct ktimer *timer, uint64_t deadline);
+
+// Disarms a timer, waiting for its callback if it's running right now (so it
+// can't be used from the callback itself). Returns false if it wasn't pending.
+bool ktimer_cancel(struct ktimer *timer);
+
+// Used by the scheduler to expire timers, and then to program the CPU timer
+// for the next one (or the end of a slice, in milliseconds, if that's sooner)
+void ktimer_run(uint64_t now);
+void ktimer_program(uint64_t now, uint64_t slice);
+
+#endif  // NINEX_KTIMER_H
@@ -2,14 +2,19 @@
 #define NINEX_PROC_H
 
 #include <arch/irqchip.h>
+#include <lib/cpumask.h>
 #include <lib/htab.h>
 #include <lib/queue.h>
+#include <lib/rbtree.h>
 #include <lib/types.h>
 #include <lib/vec.h>
+#include <ninex/ktimer.h>
 #include <vm/virt.h>
 
 #define DEFAULT_TIMESLICE 20  // A default timeslice of 20 milleseconds
+#define PROC_TABLE_SIZE UINT16_MAX  // Highest number of processes (and PIDs)
 
+struct condvar;
 struct thread;
 typedef struct process {
   uint32_t pid, ppid;
@@ -20,6 +25,10 @@ typedef struct process {
   struct hash_table handles;
   vm_space_t *space;
   int fd_counter, status;
+
+  // Protects 'threads', and 'space' from being torn down under anyone
+  // looking at it from outside of the process
+  lock_t lock;
 } proc_t;
 
 typedef struct thread {
@@ -28,8 +37,36 @@ typedef struct thread {
 
   cpu_ctx_t context;
   void *fpu_save_area;
+  int fpu_cpu;  // CPU whose FPU registers last held 'fpu_save_area'
   bool no_queue;
-  uintptr_t syscall_stack;
+  uintptr_t syscall_stack;  // Top of the kernel stack (see cpu_create_kctx)
+  void *bounce;  // Buffer for read() and write() to stage file data in
+
+  // Scheduler state, protected by the runqueue of 'cpu' (see sched.c)
+  int cpu;       // CPU whose runqueue the thread is on (or last ran on)
+  bool queued;   // Waiting in the runqueue of 'cpu'
+  bool on_cpu;   // Some CPU is still running on the thread's stack
+
+  // CPUs the thread may run on, where an empty mask means any of them that
+  // aren't isolated (see sched_set_affinity)
+  cpumask_t affinity;
+
+  // Wakes the thread up from thread_sleep_until
+  struct ktimer sleep_timer;
+
+  // Condvar whose waitqueue the thread is linked on, which is protected by
+  // that condvar's lock
+  struct condvar *waiting_on;
+
+  // Fair scheduling state, where 'vruntime' is the time the thread spent
+  // running (in nanoseconds), scaled down the higher its weight (from 'nice')
+  int nice;
+  uint64_t vruntime, exec_start;
+  struct rb_node run_node;
+
+  // Real-time scheduling state (see SCHED_FIFO/SCHED_RR)
+  uint8_t policy, rt_priority;
+  uint64_t rt_remaining;  // Nanoseconds left of a SCHED_RR slice
 
 #ifdef __x86_64__
   uintptr_t client_fs, client_gs;
@@ -43,11 +80,21 @@ struct exec_args {
   uintptr_t entry;
 };
 
+extern proc_t *kernel_process;
+// Both set errno and return NULL on failure
 proc_t *create_process(proc_t *parent, vm_space_t *space, char *ttydev);
+proc_t *proc_find(uint32_t pid);
 thread_t *kthread_create(uintptr_t entry, uint64_t arg1);
 thread_t *uthread_create(proc_t *parent,
                          const char *filepath,
                          struct exec_args arg,
                          bool elf);
 
+// Tears down a process that never got to run (like one whose executable
+// failed to load), releasing its handles, space and PID
+void destroy_process(proc_t *process);
+
+// Frees a dead thread, which has to be off every CPU and runqueue by now
+void thread_destroy(thread_t *thread);
+
 #endif  // NINEX_PROC_H
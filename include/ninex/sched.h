@@ -6,11 +6,36 @@
 // Define a threadlist as a TAILQ of threads
 TAILQ_HEAD(threadlist, thread);
 
+// Range of nice values, where lower means a bigger share of the CPU
+#define NICE_MIN -20
+#define NICE_MAX 19
+
+// Scheduling policies, where real-time threads (FIFO and RR) always run
+// before normal ones, and the highest 'rt_priority' goes first among them
+#define SCHED_OTHER 0
+#define SCHED_FIFO 1
+#define SCHED_RR 2
+#define RT_PRIO_MAX 99
+
 void sched_queue(thread_t *thread);
 void sched_dequeue(thread_t *thread);
 void sched_die(thread_t *target);
 void sched_dequeue_and_yield();
 void sched_yield();
+void sched_set_nice(thread_t *thread, int nice);
+bool sched_set_policy(thread_t *thread, int policy, int priority);
+void sched_inherit(thread_t *child, thread_t *parent);
+bool sched_set_affinity(thread_t *thread, cpumask_t *mask);
+
+// Check parameters for sched_set_policy/sched_set_affinity, for callers that
+// apply them to several threads and can't fail halfway through
+bool sched_policy_valid(int policy, int priority);
+bool sched_affinity_valid(cpumask_t *mask);
+void sched_get_affinity(thread_t *thread, cpumask_t *mask);
+
+// Puts the current thread to sleep until timer_get_ns() reaches 'deadline',
+// without taking up the CPU in the meantime
+void thread_sleep_until(uint64_t deadline);
 
 void enter_scheduler();
 void reschedule(struct cpu_context *ctx);
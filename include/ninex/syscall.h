@@ -25,6 +25,21 @@
 #define SYS_GETCWD 14
 #define SYS_STAT 15
 #define SYS_FORK 16
+#define SYS_SPAWN 17
+#define SYS_VM_PROTECT 18
+#define SYS_VM_ADVISE 19
+#define SYS_SETPRIORITY 20
+#define SYS_GETPRIORITY 21
+#define SYS_SCHED_SETSCHEDULER 22
+#define SYS_SCHED_GETSCHEDULER 23
+#define SYS_SCHED_SETAFFINITY 24
+#define SYS_SCHED_GETAFFINITY 25
+#define SYS_NANOSLEEP 26
+
+// Targets for SYS_SETPRIORITY and SYS_GETPRIORITY
+#define PRIO_PROCESS 0
+#define PRIO_PGRP 1
+#define PRIO_USER 2
 
 // Arch-Specific constants for SYS_ARCHCTL
 #ifdef __x86_64__
@@ -0,0 +1,60 @@
+#ifndef VM_CACHE_H
+#define VM_CACHE_H
+
+#include <fs/handle.h>
+#include <lib/htab.h>
+#include <lib/lock.h>
+#include <vm/seg.h>
+
+// Every vnode that gets mapped keeps its pages in a cache, which is shared by
+// all of the mappings of that file. Pages are keyed by their file offset.
+// Filesystems that keep their files in memory anyway (like tmpfs) can make
+// the cache the file's storage, so that mappings use the file's own pages.
+// Otherwise, the cache is just a copy of the file, which is dropped along
+// with the last mapping.
+struct vm_cache {
+  struct hash_table pages;
+
+  // Also taken by the page fault handler, so it's only ever held with
+  // interrupts off, and never across any I/O or allocation
+  lock_t lock;
+
+  bool backing;  // The cache is the file's storage (see vm_cache_set_backing)
+  size_t users;  // Segments mapping the file (see vm_cache_hold)
+};
+
+// Makes the cache the storage of 'node', which has to be done before any
+// data is written to it, since there's nothing to read pages in from after
+void vm_cache_set_backing(struct vnode *node);
+
+// Finds the page at 'offset', reading it in from the file if needed
+struct vm_page *vm_cache_get(struct vnode *node, size_t offset);
+
+// Copy between 'buf' and the cached pages of a file whose storage the cache
+// is. Holes read back as zeroes, while writes allocate pages as needed, and
+// return how much they got through before running out of memory.
+void vm_cache_read(struct vnode *node, void *buf, size_t offset, size_t count);
+size_t vm_cache_write(struct vnode *node,
+                      const void *buf,
+                      size_t offset,
+                      size_t count);
+
+// Zeroes whatever is cached within [offset, offset + count), so that growing
+// a file doesn't bring back what shared mappings stored past its end
+void vm_cache_clear(struct vnode *node, size_t offset, size_t count);
+
+// Keeps any cached pages in sync with a write() to the file
+void vm_cache_update(struct vnode *node,
+                     const void *buf,
+                     off_t offset,
+                     size_t count);
+
+// Writes the dirty pages in [offset, offset + len) back to the file
+void vm_cache_writeback(struct vnode *node, size_t offset, size_t len);
+
+// Called as segments start and stop mapping the file, where the cache's
+// pages stay put for as long as anything maps them
+void vm_cache_hold(struct vnode *node);
+void vm_cache_release(struct vnode *node);
+
+#endif  // VM_CACHE_H
@@ -17,10 +17,17 @@
 #define MAP_ANON 0x08
 #define MAP_ANONYMOUS 0x08
 #define MAP_NODEMAND 0x10
+#define MAP_POPULATE MAP_NODEMAND
 
 // Used by proc.c to get anon seg (without insertion)
 #define __MAP_EMBED_ONLY 0x20
 
+#define MADV_NORMAL 0
+#define MADV_WILLNEED 3
+#define MADV_DONTNEED 4
+#define MADV_HUGEPAGE 14
+#define MADV_NOHUGEPAGE 15
+
 enum vm_fault {
   VM_FAULT_NONE = 0,
   VM_FAULT_WRITE = (1 << 2),
@@ -33,11 +40,18 @@ struct vm_page {
   uint32_t refcount;
   struct {
     uint32_t present : 1;
-    uint32_t unmapped : 1;
+    uint32_t dirty : 1;
     uint32_t unused : 30;
   };
 };
 
+// Anonymous pages of a segment, which are shared across fork until one side
+// writes to them (at which point it takes its own copy of the map)
+struct vm_amap {
+  struct hash_table pagelist;
+  uint32_t refcount;
+};
+
 struct vm_seg {
   uintptr_t base;
   int prot, mode;
@@ -48,20 +62,48 @@ struct vm_seg {
     bool (*fault)(struct vm_seg *, size_t, enum vm_fault);
     struct vm_seg *(*clone)(struct vm_seg *, void *);
     bool (*unmap)(struct vm_seg *, uintptr_t, size_t);
+    bool (*advise)(struct vm_seg *, uintptr_t, size_t, int);
   } ops;
 
-  struct hash_table pagelist;
-  void *context;  // Parent seg for anon, backing for file
+  struct vm_amap *amap;
+  bool needs_copy;  // Set when 'amap' might be shared with another segment
+  void *space;      // Space this segment is mapped into
+  void *context;    // Unused for anon, backing vnode for file
+  size_t offset;    // Offset into the backing vnode
+  size_t file_len;  // Bytes of the segment backed by the vnode
+  bool hugepage;    // Fault in entire leaf tables at once (MADV_HUGEPAGE)
+  bool forked;      // Mapped alike in every space that shares its tables
+
+  // Kept up to date as pages are mapped and unmapped (see seg_account)
+  size_t resident;  // Pages mapped into the space
+  size_t anon;      // Pages held by the amap
 };
 
 /* This function has a diffrent amount of parameters for the segment type
  *   - For anonymous segments, an example call would look like this...
  *     vm_create_seg(mode <must be MAP_ANON>, prot, len, <optional> hint)
  *   - For file mappings, the call would look like this...
- *     vm_create_seg(mode <must be MAP_FILE>, prot, len, resource, <optional>
- * hint)
+ *     vm_create_seg(mode <must be MAP_FILE>, prot, len, vnode, offset,
+ * <optional> hint)
  */
 struct vm_seg *vm_create_seg(int mode, ...);
 struct vm_seg *vm_find_seg(uintptr_t addr, size_t *offset);
 
+// Unmaps and frees a segment, dropping its reference to the backing vnode
+void vm_seg_destroy(struct vm_seg *sg);
+
+// Change the protection of (or give advice about) the pages within
+// [addr, addr + len), which must be entirely mapped. Segments are split
+// and merged as needed, so that each one keeps a single protection.
+bool vm_seg_protect(uintptr_t addr, size_t len, int prot);
+bool vm_seg_advise(uintptr_t addr, size_t len, int advice);
+
+// Inserts a segment created with __MAP_EMBED_ONLY into 'space' at 'base',
+// backing it with the contiguous pages at 'phys' (or on demand, if zero)
+void vm_seg_embed(struct vm_seg *sg,
+                  void *space,
+                  uintptr_t base,
+                  uintptr_t phys);
+void vm_seg_init();
+
 #endif  // VM_SEG_H
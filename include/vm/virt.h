@@ -1,6 +1,7 @@
 #ifndef VM_VIRT_H
 #define VM_VIRT_H
 
+#include <lib/lock.h>
 #include <lib/stivale2.h>
 #include <lib/vec.h>
 #include <vm/seg.h>
@@ -18,18 +19,28 @@ typedef enum {
   VM_PAGE_HUGE = (1 << 8),
 
   // Cache flags
-  VM_CACHE_MASK = (4 << 15),
+  VM_CACHE_MASK = (3 << 15),
   VM_CACHE_UNCACHED = (1 << 15),
   VM_CACHE_WRITE_COMBINING = (2 << 15),
   VM_CACHE_WRITE_PROTECT = (3 << 15),
 } vm_flags_t;
 
+// Highest number of CPUs that a space can be loaded on
+#define VM_MAX_CPUS 256
+
 // Repersents a virtual memory space, in which pages and objects are mapped
 typedef struct {
   uint64_t root;
-  uint32_t asid;
-  bool active;
+  uint64_t ctx_id, tlb_gen;  // Unique ID, and count of TLB flushes
+  uint64_t cpus[VM_MAX_CPUS / 64];  // CPUs that have the space loaded
+  size_t pt_pages;  // Page tables used by the space (excluding the root)
+  size_t resident;  // Pages mapped by the space's segments
+  size_t anon;      // Private pages held by the space's segments
+  bool active;  // Cleared once the space starts being torn down
 
+  // Protects the segments (and their amaps) from being changed while someone
+  // else walks them, see vm_space_lock
+  lock_t lock;
   vec_t(struct vm_seg *) mappings;
   uintptr_t mmap_base;
 } vm_space_t;
@@ -40,9 +51,29 @@ void vm_map_range(vm_space_t *space,
                   uintptr_t virt,
                   size_t len,
                   int flags);
-void vm_unmap_range(vm_space_t *space, uintptr_t virt, size_t len);
+size_t vm_unmap_range(vm_space_t *space, uintptr_t virt, size_t len);
+void vm_protect_range(vm_space_t *space,
+                      uintptr_t virt,
+                      size_t len,
+                      int flags);
+
+// Maps device memory into the direct map with the given cache attributes
+// (one of VM_CACHE_*), returning its virtual address
+void *vm_map_mmio(uintptr_t phys, size_t len, int cache);
+
+// Memory usage of a space, in pages (except for 'pss', which is in bytes)
+struct vm_usage {
+  size_t resident;  // Every page mapped, including cached and zero pages
+  size_t anon;      // Private (anonymous or copied) pages
+  size_t cow;       // Private pages still shared copy-on-write after fork
+  size_t pss;       // Private pages, with shared ones split among sharers
+  size_t pt_pages;  // Page tables
+};
 
 // Functions related to the VM address space
+bool vm_space_lock(vm_space_t *space);
+void vm_space_unlock(vm_space_t *space, bool irq);
+void vm_space_usage(vm_space_t *space, struct vm_usage *usage);
 void vm_space_load(vm_space_t *space);
 void vm_space_destroy(vm_space_t *space);
 void vm_space_fork(vm_space_t *old, vm_space_t *cur);
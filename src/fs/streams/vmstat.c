@@ -0,0 +1,102 @@
+#include <fs/devtmpfs.h>
+#include <lib/builtin.h>
+#include <ninex/proc.h>
+#include <vm/virt.h>
+#include <vm/vm.h>
+
+#define KB(pages) (((pages) * cur_config->page_size) / 1024)
+
+// Prints the memory usage of every process into a newly allocated buffer
+static char *vmstat_generate(size_t *length) {
+  size_t capacity = VM_PAGE_SIZE, len = 0;
+  char *text = kmalloc(capacity);
+
+  len += snprintf(text, capacity, "%-6s %10s %10s %10s %10s %10s\n", "PID",
+                  "RSS(KB)", "ANON(KB)", "COW(KB)", "PSS(KB)", "PT(KB)");
+
+  for (uint32_t pid = 0; pid < PROC_TABLE_SIZE; pid++) {
+    proc_t *proc = proc_find(pid);
+    if (proc == NULL) continue;
+
+    // Exiting processes drop their space with the lock held
+    struct vm_usage usage;
+    bool irq = spinlock_irq(&proc->lock);
+    bool alive = (proc->space != NULL);
+    if (alive) vm_space_usage(proc->space, &usage);
+    spinrelease_irq(&proc->lock, irq);
+    if (!alive) continue;
+
+    // A single line never comes close to 128 characters
+    if (capacity - len < 128) {
+      capacity *= 2;
+      text = krealloc(text, capacity);
+    }
+
+    len += snprintf(text + len, capacity - len,
+                    "%-6u %10lu %10lu %10lu %10lu %10lu\n", pid,
+                    KB(usage.resident), KB(usage.anon), KB(usage.cow),
+                    usage.pss / 1024, KB(usage.pt_pages));
+  }
+
+  *length = len;
+  return text;
+}
+
+static ssize_t vmstat_read(struct vnode *bck,
+                           void *buf,
+                           off_t offset,
+                           size_t count) {
+  (void)bck;
+
+  // The numbers are regenerated on every read, so readers should grab the
+  // entire table in one go for a consistent snapshot
+  size_t length;
+  char *text = vmstat_generate(&length);
+  if ((size_t)offset >= length) {
+    kfree(text);
+    return 0;
+  }
+
+  count = MIN(count, length - offset);
+  memcpy(buf, text + offset, count);
+  kfree(text);
+  return count;
+}
+
+static ssize_t vmstat_write(struct vnode *bck,
+                            const void *buf,
+                            off_t offset,
+                            size_t count) {
+  (void)bck;
+  (void)buf;
+  (void)offset;
+  (void)count;
+
+  return -1;
+}
+
+static ssize_t vmstat_resize(struct vnode *bck, off_t new_size) {
+  (void)bck;
+  (void)new_size;
+  return 0;
+}
+
+static void vmstat_close(struct vnode *bck) {
+  spinlock(&bck->lock);
+  bck->refcount--;
+  spinrelease(&bck->lock);
+}
+
+void setup_vmstat_stream() {
+  struct vnode *vmstat_bck = devtmpfs_create_device("vmstat", 0);
+
+  // Setup '/dev/vmstat'
+  vmstat_bck->st.st_dev = devtmpfs_create_id(0);
+  vmstat_bck->st.st_mode = 0444 | S_IFCHR;
+  vmstat_bck->st.st_nlink = 1;
+  vmstat_bck->refcount = 1;
+  vmstat_bck->read = vmstat_read;
+  vmstat_bck->write = vmstat_write;
+  vmstat_bck->resize = vmstat_resize;
+  vmstat_bck->close = vmstat_close;
+}
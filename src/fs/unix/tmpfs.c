@@ -1,27 +1,25 @@
 #include <fs/handle.h>
 #include <fs/vfs.h>
 #include <lib/builtin.h>
+#include <vm/cache.h>
 #include <vm/vm.h>
 
-struct tmpfs_vnode {
-  struct vnode;
-  size_t capacity;
-  char *data;
-};
-
+// Files live in their page cache, which mappings of them use directly (see
+// vm_cache_set_backing), so that nothing is ever kept twice
 static ssize_t tmpfs_read(struct vnode *bck,
                           void *buf,
                           off_t offset,
                           size_t count) {
-  struct tmpfs_vnode *b = (struct tmpfs_vnode *)bck;
-  spinlock(&b->lock);
+  spinlock(&bck->lock);
 
   // Truncate the read if the size is too big!
-  if (offset + count > b->st.st_size) count -= (offset + count) - b->st.st_size;
+  if (offset >= bck->st.st_size)
+    count = 0;
+  else if (offset + count > (size_t)bck->st.st_size)
+    count = bck->st.st_size - offset;
 
-  // Read the file into the buffer
-  memcpy(buf, b->data + offset, count);
-  spinrelease(&b->lock);
+  vm_cache_read(bck, buf, offset, count);
+  spinrelease(&bck->lock);
   return count;
 }
 
@@ -29,40 +27,35 @@ static ssize_t tmpfs_write(struct vnode *bck,
                            const void *buf,
                            off_t offset,
                            size_t count) {
-  struct tmpfs_vnode *b = (struct tmpfs_vnode *)bck;
-  spinlock(&b->lock);
-
-  // Grow the file if needed!
-  if (offset + count > b->capacity) {
-    while (offset + count > b->capacity)
-      b->capacity <<= 1;
+  spinlock(&bck->lock);
 
-    b->data = krealloc(b->data, b->capacity);
-  }
+  // Anything between the old end of the file and the write reads as zeroes
+  if (offset > bck->st.st_size)
+    vm_cache_clear(bck, bck->st.st_size, offset - bck->st.st_size);
 
-  // Update stuff...
-  memcpy(b->data + offset, buf, count);
-  b->st.st_size += count;
-  spinrelease(&b->lock);
+  // Pages get allocated as they're written to, growing the file as needed
+  size_t written = vm_cache_write(bck, buf, offset, count);
+  if (offset + written > (size_t)bck->st.st_size)
+    bck->st.st_size = offset + written;
 
-  return count;
+  spinrelease(&bck->lock);
+  return (written == 0 && count != 0) ? -1 : (ssize_t)written;
 }
 
 static ssize_t tmpfs_resize(struct vnode *bck, off_t new_size) {
-  struct tmpfs_vnode *b = (struct tmpfs_vnode *)bck;
-  spinlock(&b->lock);
+  spinlock(&bck->lock);
 
   // Prevent downsizing...
-  if (new_size <= b->capacity) return -1;
-
-  // Grow the file
-  while (new_size > b->capacity)
-    b->capacity <<= 1;
-  b->data = krealloc(b->data, b->capacity);
+  if (new_size < bck->st.st_size) {
+    spinrelease(&bck->lock);
+    return -1;
+  }
 
-  // Update data structures
-  b->st.st_size = new_size;
-  spinrelease(&b->lock);
+  // The new part of the file is a hole, so no pages are needed until it's
+  // written to
+  vm_cache_clear(bck, bck->st.st_size, new_size - bck->st.st_size);
+  bck->st.st_size = new_size;
+  spinrelease(&bck->lock);
   return new_size;
 }
 
@@ -78,12 +71,10 @@ static struct vnode *tmpfs_open(struct vfs_ent *node,
   // We should only get called when creating a new resource/node
   if (!new_node) return NULL;
 
-  struct tmpfs_vnode *bck =
-      (struct tmpfs_vnode *)create_resource(sizeof(struct tmpfs_vnode));
+  struct vnode *bck = create_resource(0);
 
   // Fill in the backing with proper values
-  bck->capacity = 4096;
-  bck->data = kmalloc(bck->capacity);
+  vm_cache_set_backing(bck);
   bck->st.st_dev = 1;  // TODO: Respect Device IDs
   bck->st.st_size = 0;
   bck->st.st_blocks = 0;
@@ -97,12 +88,11 @@ static struct vnode *tmpfs_open(struct vfs_ent *node,
   bck->resize = tmpfs_resize;
   bck->close = tmpfs_close;
 
-  return (struct vnode *)bck;
+  return bck;
 }
 
 static struct vnode *tmpfs_mkdir(struct vfs_ent *node, mode_t mode) {
-  struct tmpfs_vnode *bck =
-      (struct tmpfs_vnode *)create_resource(sizeof(struct tmpfs_vnode));
+  struct vnode *bck = create_resource(0);
 
   bck->st.st_dev = 1;
   bck->st.st_size = 0;
@@ -112,12 +102,11 @@ static struct vnode *tmpfs_mkdir(struct vfs_ent *node, mode_t mode) {
   bck->st.st_mode = (mode & ~S_IFMT) | S_IFDIR;
   bck->st.st_nlink = 1;
 
-  return (struct vnode *)bck;
+  return bck;
 }
 
 static struct vnode *tmpfs_link(struct vfs_ent *node, mode_t mode) {
-  struct tmpfs_vnode *bck =
-      (struct tmpfs_vnode *)create_resource(sizeof(struct tmpfs_vnode));
+  struct vnode *bck = create_resource(0);
 
   bck->st.st_dev = 1;
   bck->st.st_size = 0;
@@ -127,7 +116,7 @@ static struct vnode *tmpfs_link(struct vfs_ent *node, mode_t mode) {
   bck->st.st_mode = (mode & ~S_IFMT) | S_IFLNK;
   bck->st.st_nlink = 1;
 
-  return (struct vnode *)bck;
+  return bck;
 }
 
 static struct vfs_ent *tmpfs_mount(const char *basename,
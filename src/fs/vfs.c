@@ -280,4 +280,5 @@ void vfs_setup() {
   initramfs_populate(mods);
   setup_unix_streams();
   setup_random_streams();
+  setup_vmstat_stream();
 }
@@ -223,8 +223,7 @@ void *laihost_scan(const char *signature, size_t index) {
 }
 
 void *laihost_map(size_t base, size_t length) {
-  (void)length;
-  return (void *)(base + VM_MEM_OFFSET);
+  return vm_map_mmio(base, length, VM_CACHE_UNCACHED);
 }
 
 void laihost_unmap(void *base, size_t length) {
@@ -1,16 +1,71 @@
 #include <arch/smp.h>
+#include <arch/timer.h>
 #include <ninex/condvar.h>
+#include <ninex/ktimer.h>
 
 void cv_wait(cv_t *c) {
   int status = spinlock_irq(&c->lock);
-  TAILQ_INSERT_TAIL(&c->waiters, this_cpu->cur_thread, queue);
-  sched_dequeue(this_cpu->cur_thread);
+  thread_t *self = this_cpu_read(cur_thread);
+  TAILQ_INSERT_TAIL(&c->waiters, self, queue);
+  self->waiting_on = c;
+  sched_dequeue(self);
   c->n_waiters++;
 
   spinrelease_irq(&c->lock, status);
   sched_yield();
 }
 
+struct cv_timeout {
+  struct ktimer timer;
+  cv_t *cv;
+  bool timed_out;
+};
+
+// Takes the waiter off of the condvar, unless a signal beat us to it
+static void cv_expire(struct ktimer *timer) {
+  struct cv_timeout *timeout = (struct cv_timeout *)timer;
+  thread_t *waiter = timer->data, *thread;
+
+  int status = spinlock_irq(&timeout->cv->lock);
+  TAILQ_FOREACH(thread, &timeout->cv->waiters, queue) {
+    if (thread != waiter) continue;
+
+    TAILQ_REMOVE(&timeout->cv->waiters, waiter, queue);
+    waiter->waiting_on = NULL;
+    timeout->cv->n_waiters--;
+    timeout->timed_out = true;
+    sched_queue(waiter);
+    break;
+  }
+
+  spinrelease_irq(&timeout->cv->lock, status);
+}
+
+bool cv_timedwait(cv_t *c, uint64_t deadline) {
+  thread_t *self = this_cpu_read(cur_thread);
+  struct cv_timeout timeout = {.cv = c};
+  ktimer_init(&timeout.timer, cv_expire, self);
+
+  int status = spinlock_irq(&c->lock);
+  if (deadline <= timer_get_ns()) {
+    spinrelease_irq(&c->lock, status);
+    return false;
+  }
+
+  TAILQ_INSERT_TAIL(&c->waiters, self, queue);
+  self->waiting_on = c;
+  sched_dequeue(self);
+  c->n_waiters++;
+
+  // Interrupts stay off until we yield, so the timer can't go off early
+  ktimer_arm(&timeout.timer, deadline);
+  spinrelease(&c->lock);
+  sched_yield();
+
+  ktimer_cancel(&timeout.timer);
+  return !timeout.timed_out;
+}
+
 void cv_signal(cv_t *c) {
   int status = spinlock_irq(&c->lock);
 
@@ -21,9 +76,27 @@ void cv_signal(cv_t *c) {
 
   thread_t *waiter = TAILQ_FIRST(&c->waiters);
   TAILQ_REMOVE(&c->waiters, waiter, queue);
+  waiter->waiting_on = NULL;
   sched_queue(waiter);
   c->n_waiters--;
 
   spinrelease_irq(&c->lock, status);
   return;
 }
+
+void cv_cancel_wait(thread_t *thread) {
+  cv_t *c;
+
+  // The thread can move on to another condvar until we hold the lock of the
+  // one it's on, so check again once we do
+  while ((c = ATOMIC_READ(&thread->waiting_on)) != NULL) {
+    int status = spinlock_irq(&c->lock);
+    if (thread->waiting_on == c) {
+      TAILQ_REMOVE(&c->waiters, thread, queue);
+      thread->waiting_on = NULL;
+      c->n_waiters--;
+    }
+
+    spinrelease_irq(&c->lock, status);
+  }
+}
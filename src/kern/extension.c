@@ -64,11 +64,9 @@ static struct kernel_extension *load_extension(struct vnode *file) {
 
       // Now, we can remove write permissions, if they aren't needed.
       if (!(phdr.p_flags & PF_W)) {
-        vm_unmap_range(&kernel_space, va,
-                       ALIGN_UP(misalign + phdr.p_memsz, 0x1000));
-        vm_map_range(&kernel_space, pa, va,
-                     ALIGN_UP(misalign + phdr.p_memsz, 0x1000),
-                     pf & ~VM_PERM_WRITE);
+        vm_protect_range(&kernel_space, va,
+                         ALIGN_UP(misalign + phdr.p_memsz, 0x1000),
+                         pf & ~VM_PERM_WRITE);
       }
 
       // Finally, update 'load_end' if needed
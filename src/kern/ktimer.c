@@ -0,0 +1,225 @@
+#include <arch/smp.h>
+#include <arch/timer.h>
+#include <lib/builtin.h>
+#include <lib/lock.h>
+#include <ninex/ktimer.h>
+
+// Each CPU keeps its timers on a hierarchical wheel, which ticks once every
+// millisecond (the resolution of the CPU timer). Every level has 64 slots,
+// which cover 64 times as many ticks as the ones a level below, and timers
+// go into the lowest level that reaches far enough, only moving down
+// (cascading) once the clock gets close. Arming and cancelling are O(1), and
+// the bitmaps of non-empty slots let a tickless CPU skip straight to the
+// next timer, instead of walking every tick in between.
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 5
+#define NS_PER_TICK 1000000UL
+
+#define level_shift(level) (WHEEL_BITS * (level))
+#define level_slot(tick, level) \
+  (((tick) >> level_shift(level)) & (WHEEL_SLOTS - 1))
+
+TAILQ_HEAD(ktimer_list, ktimer);
+
+struct timer_wheel {
+  lock_t lock;
+  bool ready;
+  uint64_t clock;       // Next tick to be processed
+  uint64_t programmed;  // When the CPU timer goes off next (in nanoseconds)
+  uint64_t pending[WHEEL_LEVELS];  // Bitmaps of the non-empty slots
+  struct ktimer_list slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  struct ktimer *running;  // Timer whose callback is being run
+  size_t count;
+};
+
+static DEFINE_PERCPU(struct timer_wheel, timer_wheel);
+extern int resched_slot;
+
+// Returns the current CPU's wheel, where interrupts have to be disabled
+static struct timer_wheel *this_wheel(uint64_t now) {
+  struct timer_wheel *wheel = this_cpu_ptr(timer_wheel);
+  if (wheel->ready) return wheel;
+
+  for (int level = 0; level < WHEEL_LEVELS; level++)
+    for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+      TAILQ_INIT(&wheel->slots[level][slot]);
+
+  wheel->clock = now / NS_PER_TICK;
+  wheel->programmed = UINT64_MAX;
+  wheel->ready = true;
+  return wheel;
+}
+
+// Puts a timer into the slot that covers its tick, relative to the clock,
+// where timers too far out for the top level wait in its furthest slot
+static void wheel_add(struct timer_wheel *wheel, struct ktimer *timer) {
+  uint64_t tick = MAX(timer->tick, wheel->clock);
+  uint64_t delta = tick - wheel->clock;
+  uint64_t max = (1UL << level_shift(WHEEL_LEVELS)) - 1;
+  if (delta > max) tick = wheel->clock + max;
+
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 && delta >= (1UL << level_shift(level + 1)))
+    level++;
+
+  timer->level = level;
+  timer->slot = level_slot(tick, level);
+  timer->pending = true;
+  TAILQ_INSERT_TAIL(&wheel->slots[level][timer->slot], timer, link);
+  wheel->pending[level] |= (1UL << timer->slot);
+  wheel->count++;
+}
+
+static void wheel_remove(struct timer_wheel *wheel, struct ktimer *timer) {
+  struct ktimer_list *slot = &wheel->slots[timer->level][timer->slot];
+  TAILQ_REMOVE(slot, timer, link);
+  if (TAILQ_EMPTY(slot)) wheel->pending[timer->level] &= ~(1UL << timer->slot);
+
+  timer->pending = false;
+  wheel->count--;
+}
+
+// Moves the timers of every slot that starts at 'tick' down a level (or
+// more), which has to be done as soon as the clock gets there
+static void wheel_cascade(struct timer_wheel *wheel, uint64_t tick) {
+  for (int level = 1; level < WHEEL_LEVELS; level++) {
+    if (tick & ((1UL << level_shift(level)) - 1)) break;
+
+    struct ktimer_list *slot = &wheel->slots[level][level_slot(tick, level)];
+    struct ktimer *timer;
+    while ((timer = TAILQ_FIRST(slot)) != NULL) {
+      wheel_remove(wheel, timer);
+      wheel_add(wheel, timer);
+    }
+  }
+}
+
+// Returns the first tick at which something on the wheel needs attention,
+// be it expiring or cascading (or UINT64_MAX if there's nothing)
+static uint64_t wheel_next_tick(struct timer_wheel *wheel) {
+  uint64_t next = UINT64_MAX;
+
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    uint64_t pending = wheel->pending[level];
+    if (pending == 0) continue;
+
+    // A slot is reached once the clock crosses into it, with the one at the
+    // next crossing coming first
+    uint64_t step = 1UL << level_shift(level);
+    uint64_t base = ALIGN_UP(wheel->clock, step);
+    int cur = level_slot(base, level);
+    uint64_t rotated = (pending >> cur) | (pending << ((64 - cur) % 64));
+
+    next = MIN(next, base + __builtin_ctzl(rotated) * step);
+  }
+
+  return next;
+}
+
+void ktimer_init(struct ktimer *timer,
+                 void (*func)(struct ktimer *timer),
+                 void *data) {
+  *timer = (struct ktimer){.func = func, .data = data};
+}
+
+void ktimer_arm(struct ktimer *timer, uint64_t deadline) {
+  bool irq = asm_check_intr();
+  asm volatile("cli");
+
+  uint64_t now = timer_get_ns();
+  struct timer_wheel *wheel = this_wheel(now);
+  spinlock(&wheel->lock);
+
+  // An empty wheel can skip ahead, which keeps new timers off the top level
+  // after a long time without any
+  if (wheel->count == 0) wheel->clock = MAX(wheel->clock, now / NS_PER_TICK);
+
+  timer->deadline = deadline;
+  timer->tick = DIV_ROUNDUP(deadline, NS_PER_TICK);
+  timer->wheel = wheel;
+  wheel_add(wheel, timer);
+
+  // Make sure the CPU timer goes off in time
+  uint64_t target = timer->tick * NS_PER_TICK;
+  bool reprogram = (target < wheel->programmed);
+  if (reprogram) wheel->programmed = target;
+  spinrelease(&wheel->lock);
+
+  if (reprogram) {
+    uint64_t ms = (target > now) ? DIV_ROUNDUP(target - now, NS_PER_TICK) : 1;
+    timer_oneshot(ms, resched_slot);
+  }
+
+  if (irq) asm volatile("sti");
+}
+
+bool ktimer_cancel(struct ktimer *timer) {
+  struct timer_wheel *wheel = ATOMIC_READ(&timer->wheel);
+  if (wheel == NULL) return false;
+
+  for (;;) {
+    bool irq = spinlock_irq(&wheel->lock);
+    bool pending = timer->pending, running = (wheel->running == timer);
+    if (pending) wheel_remove(wheel, timer);
+    spinrelease_irq(&wheel->lock, irq);
+
+    if (!running) return pending;
+    asm volatile("pause");
+  }
+}
+
+void ktimer_run(uint64_t now) {
+  struct timer_wheel *wheel = this_wheel(now);
+  uint64_t now_tick = now / NS_PER_TICK;
+  spinlock(&wheel->lock);
+
+  while (wheel->clock <= now_tick) {
+    // Nothing happens before 'next', so jump right to it
+    uint64_t next = wheel_next_tick(wheel);
+    if (next > now_tick) {
+      wheel->clock = now_tick + 1;
+      break;
+    }
+
+    wheel->clock = next;
+    wheel_cascade(wheel, next);
+
+    // Run the callbacks without the lock, so that they're free to (re)arm
+    // timers of their own
+    struct ktimer_list *slot = &wheel->slots[0][level_slot(next, 0)];
+    struct ktimer *timer;
+    while ((timer = TAILQ_FIRST(slot)) != NULL) {
+      wheel_remove(wheel, timer);
+      wheel->running = timer;
+      spinrelease(&wheel->lock);
+
+      timer->func(timer);
+
+      spinlock(&wheel->lock);
+      wheel->running = NULL;
+    }
+
+    wheel->clock = next + 1;
+  }
+
+  spinrelease(&wheel->lock);
+}
+
+void ktimer_program(uint64_t now, uint64_t slice) {
+  struct timer_wheel *wheel = this_wheel(now);
+  spinlock(&wheel->lock);
+
+  uint64_t next = wheel_next_tick(wheel);
+  uint64_t target = (next == UINT64_MAX) ? UINT64_MAX : next * NS_PER_TICK;
+  if (slice != 0) target = MIN(target, now + slice * NS_PER_TICK);
+
+  wheel->programmed = target;
+  spinrelease(&wheel->lock);
+
+  if (target == UINT64_MAX)
+    timer_stop();
+  else
+    timer_oneshot((target > now) ? DIV_ROUNDUP(target - now, NS_PER_TICK) : 1,
+                  resched_slot);
+}
@@ -1,23 +1,47 @@
 #include <arch/smp.h>
 #include <fs/vfs.h>
 #include <lib/builtin.h>
+#include <lib/errno.h>
 #include <lib/kcon.h>
+#include <lib/lock.h>
 #include <lib/types.h>
 #include <ninex/proc.h>
 #include <vm/phys.h>
 #include <vm/vm.h>
 
-#define PROC_TABLE_SIZE UINT16_MAX
+// Freed thread objects are kept around on each CPU, so that creating a
+// thread doesn't always have to go through kmalloc
+#define THREAD_CACHE_SIZE 8
+
+struct thread_cache {
+  lock_t lock;
+  thread_t *threads[THREAD_CACHE_SIZE];
+  size_t count;
+};
 
 struct process *kernel_process;
 static proc_t *process_table[PROC_TABLE_SIZE];
+static DEFINE_PERCPU(struct thread_cache, thread_cache);
 
 proc_t *create_process(proc_t *parent, vm_space_t *space, char *ttydev) {
   // Setup the basics...
   proc_t *process = kmalloc(sizeof(proc_t));
   if (process == NULL) {
+    set_errno(ENOMEM);
+    return NULL;
+  }
+
+  // Setup the address space
+  bool own_space = (space == NULL);
+  if (own_space) space = vm_space_create();
+  if (space == NULL) {
+    kfree(process);
+    set_errno(ENOMEM);
     return NULL;
-  } else if (parent) {
+  }
+  process->space = space;
+
+  if (parent) {
     process->ppid = parent->pid;
     process->cwd = parent->cwd;
     vec_push(&parent->children, process);
@@ -25,10 +49,6 @@ proc_t *create_process(proc_t *parent, vm_space_t *space, char *ttydev) {
     process->cwd = root_node;
   }
 
-  // Setup the address space
-  if (!space) space = vm_space_create();
-  process->space = space;
-
   // Insert the files
   if (ttydev == NULL) ttydev = "/dev/ttyS0";
 
@@ -47,19 +67,93 @@ proc_t *create_process(proc_t *parent, vm_space_t *space, char *ttydev) {
     }
   }
 
-  // No PID, no process!
-  kfree(process);
+  // No PID, no process! (though a space we were handed stays the caller's)
+  if (!own_space) process->space = NULL;
+  destroy_process(process);
+  set_errno(EAGAIN);
   return NULL;
 }
 
+void destroy_process(proc_t *process) {
+  proc_t *parent = proc_find(process->ppid);
+  if (parent) vec_remove(&parent->children, process);
+
+  // Only give up the PID if it's actually ours
+  proc_t *expected = process;
+  ATOMIC_CAS(&process_table[process->pid], &expected, NULL);
+
+  for (int i = 0; i < process->handles.capacity; i++) {
+    struct handle *hl = process->handles.data[i];
+    kfree(process->handles.keys[i]);
+    if (hl == NULL) continue;
+
+    hl->node->close(hl->node);
+    if (--hl->refcount == 0) kfree(hl);
+  }
+
+  kfree(process->handles.keys);
+  kfree(process->handles.data);
+  if (process->space) vm_space_destroy(process->space);
+  vec_deinit(&process->children);
+  vec_deinit(&process->threads);
+  kfree(process);
+}
+
+proc_t *proc_find(uint32_t pid) {
+  if (pid >= PROC_TABLE_SIZE) return NULL;
+
+  return ATOMIC_READ(&process_table[pid]);
+}
+
+// Returns a zeroed thread, from the cache if possible. The cache might belong
+// to another CPU by the time it's locked, which is harmless.
+static thread_t *thread_alloc() {
+  thread_t *thread = NULL;
+
+  if (this_cpu_or_null != NULL) {
+    struct thread_cache *cache = this_cpu_ptr(thread_cache);
+    bool irq = spinlock_irq(&cache->lock);
+    if (cache->count > 0) thread = cache->threads[--cache->count];
+    spinrelease_irq(&cache->lock, irq);
+  }
+
+  if (thread == NULL) return kmalloc(sizeof(thread_t));
+
+  memset(thread, 0, sizeof(thread_t));
+  return thread;
+}
+
+void thread_destroy(thread_t *thread) {
+  proc_t *parent = thread->parent;
+  bool irq = spinlock_irq(&parent->lock);
+  vec_remove(&parent->threads, thread);
+  spinrelease_irq(&parent->lock, irq);
+  cpu_destroy_ctx(thread);
+  kfree(thread->bounce);
+
+  struct thread_cache *cache = this_cpu_ptr(thread_cache);
+  irq = spinlock_irq(&cache->lock);
+  if (cache->count < THREAD_CACHE_SIZE) {
+    cache->threads[cache->count++] = thread;
+    thread = NULL;
+  }
+  spinrelease_irq(&cache->lock, irq);
+
+  if (thread != NULL) kfree(thread);
+}
+
 thread_t *kthread_create(uintptr_t entry, uint64_t arg1) {
   if (kernel_process == NULL)
     kernel_process = create_process(NULL, &kernel_space, "/dev/ttyS0");
 
-  thread_t *new_thread = kmalloc(sizeof(thread_t));
+  thread_t *new_thread = thread_alloc();
   new_thread->parent = kernel_process;
+  new_thread->cpu = -1;
   new_thread->tid = kernel_process->children.length;
+
+  bool irq = spinlock_irq(&kernel_process->lock);
   vec_push(&kernel_process->threads, new_thread);
+  spinrelease_irq(&kernel_process->lock, irq);
 
   cpu_create_kctx(new_thread, entry, arg1);
   return new_thread;
@@ -72,25 +166,40 @@ bool load_elf(vm_space_t *space,
               uintptr_t *entry) {
   // First, try to open the file...
   bool status = false;
+  Elf64_Phdr *phdrs = NULL;
   struct vfs_resolved_node res = vfs_resolve(NULL, (char *)path, 0);
-  if (res.target == NULL) {
+  if (res.target == NULL || res.target->backing == NULL) {
     kfree(res.raw_string);
+    set_errno(ENOENT);
     return false;
   }
   struct vnode *file = res.target->backing;
 
-  // Check the EHDR file header.
+  // Check the EHDR file header. Anything wrong with the headers from here on
+  // means the file isn't a valid executable.
   Elf64_Ehdr ehdr;
-  file->read(file, &ehdr, 0, sizeof(Elf64_Ehdr));
-  if (!(ehdr.e_ident[0] == 0x7F && ehdr.e_ident[1] == 'E' &&
+  set_errno(ENOEXEC);
+  if (file->read(file, &ehdr, 0, sizeof(Elf64_Ehdr)) != sizeof(Elf64_Ehdr) ||
+      !(ehdr.e_ident[0] == 0x7F && ehdr.e_ident[1] == 'E' &&
         ehdr.e_ident[2] == 'L' && ehdr.e_ident[3] == 'F')) {
     klog("proc: invalid signature for %s!", path);
     goto cleanup;
+  } else if (ehdr.e_phentsize != sizeof(Elf64_Phdr)) {
+    klog("proc: unexpected e_phentsize for %s!", path);
+    goto cleanup;
   }
 
   // Load in the program headers
-  Elf64_Phdr *phdrs = kmalloc(ehdr.e_phnum * sizeof(Elf64_Phdr));
-  file->read(file, phdrs, ehdr.e_phoff, ehdr.e_phnum * ehdr.e_phentsize);
+  size_t phdrs_len = ehdr.e_phnum * sizeof(Elf64_Phdr);
+  phdrs = kmalloc(phdrs_len);
+  if (phdrs == NULL) {
+    set_errno(ENOMEM);
+    goto cleanup;
+  } else if (file->read(file, phdrs, ehdr.e_phoff, phdrs_len) !=
+             (ssize_t)phdrs_len) {
+    klog("proc: truncated program headers in %s!", path);
+    goto cleanup;
+  }
   auxval->at_phent = sizeof(Elf64_Phdr);
   auxval->at_phnum = ehdr.e_phnum;
   auxval->at_phdr = 0;
@@ -119,48 +228,35 @@ bool load_elf(vm_space_t *space,
 
     if (phdrs[i].p_type != PT_LOAD) continue;
 
-    // TODO(cleanbaja): use the segment API to map the executable
     uintptr_t misalign = phdrs[i].p_vaddr & (VM_PAGE_SIZE - 1);
     if (phdrs[i].p_memsz <= 0) {
       klog("proc: invalid p_memsz for %s?", path);
       goto cleanup;
+    } else if ((phdrs[i].p_offset & (VM_PAGE_SIZE - 1)) != misalign) {
+      klog("proc: misaligned PT_LOAD in %s!", path);
+      goto cleanup;
     }
 
-    // Translate prot to ninex format
-    int pf = VM_PERM_READ | VM_PERM_USER;
-    if (phdrs[i].p_flags & PF_W) pf |= VM_PERM_WRITE;
-    if (phdrs[i].p_flags & PF_X) pf |= VM_PERM_EXEC;
+    // Translate the ELF flags to mmap protection
+    int prot = PROT_READ;
+    if (phdrs[i].p_flags & PF_W) prot |= PROT_WRITE;
+    if (phdrs[i].p_flags & PF_X) prot |= PROT_EXEC;
 
-    // Create the segment object that corresponds to this region
+    // Map the segment as a private mapping of the file, so that its pages
+    // come straight from the page cache (and are only copied when written).
+    // Anything past p_filesz is the bss, which is backed by zeroes.
     struct vm_seg *n_seg = vm_create_seg(
-        MAP_ANON | __MAP_EMBED_ONLY | MAP_PRIVATE, phdrs[i].p_flags,
-        ALIGN_UP(misalign + phdrs[i].p_memsz, 0x1000));
-    vec_push(&space->mappings, n_seg);
-
-    // Map pages for the segment...
-    uintptr_t pa = (uintptr_t)vm_phys_alloc(
-        DIV_ROUNDUP(misalign + phdrs[i].p_memsz, 0x1000), VM_ALLOC_ZERO);
-    uintptr_t va = (base + phdrs[i].p_vaddr) & ~(VM_PAGE_SIZE - 1);
-    vm_map_range(space, pa, va, ALIGN_UP(misalign + phdrs[i].p_memsz, 0x1000),
-                 pf);
-
-    // Fill the segment.
-    memset((void *)(pa + VM_MEM_OFFSET + misalign), 0, phdrs[i].p_memsz);
-    file->read(file, (void *)(pa + VM_MEM_OFFSET + misalign), phdrs[i].p_offset,
-               phdrs[i].p_filesz);
-
-    // Finally, fill in the pagelist of the segment object
-    for (int i = 0; i < n_seg->len; i += VM_PAGE_SIZE) {
-      struct vm_page *pg = kmalloc(sizeof(struct vm_page));
-      uintptr_t spot = i * 0x1000;
-
-      htab_insert(&n_seg->pagelist, &spot, sizeof(size_t), pg);
-      pg->metadata = (void *)(pa + spot);
-      pg->refcount = 1;
-      pg->present = 1;
+        MAP_FILE | __MAP_EMBED_ONLY | MAP_PRIVATE, prot,
+        ALIGN_UP(misalign + phdrs[i].p_memsz, VM_PAGE_SIZE), file,
+        phdrs[i].p_offset - misalign);
+    if (n_seg == NULL) {
+      set_errno(ENOMEM);
+      goto cleanup;
     }
 
-    n_seg->base = va;
+    uintptr_t va = (base + phdrs[i].p_vaddr) & ~(VM_PAGE_SIZE - 1);
+    n_seg->file_len = MIN(n_seg->file_len, misalign + phdrs[i].p_filesz);
+    vm_seg_embed(n_seg, space, va, 0);
   }
 
   // Set the auxval, and mark success
@@ -169,6 +265,7 @@ bool load_elf(vm_space_t *space,
   if (*entry == 0) *entry = auxval->at_entry;
 
 cleanup:
+  kfree(phdrs);
   file->close(file);
   kfree(res.raw_string);
   return status;
@@ -188,10 +285,19 @@ thread_t *uthread_create(proc_t *parent,
     }
   }
 
-  thread_t *new_thread = kmalloc(sizeof(thread_t));
+  thread_t *new_thread = thread_alloc();
+  if (new_thread == NULL) {
+    set_errno(ENOMEM);
+    return NULL;
+  }
+
   new_thread->parent = parent;
+  new_thread->cpu = -1;
   new_thread->tid = parent->children.length;
+
+  bool irq = spinlock_irq(&parent->lock);
   vec_push(&parent->threads, new_thread);
+  spinrelease_irq(&parent->lock, irq);
 
   if (elf) {
     arg.entry = entry;
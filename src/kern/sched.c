@@ -1,66 +1,702 @@
 #include <arch/smp.h>
 #include <arch/timer.h>
+#include <lib/builtin.h>
+#include <lib/cmdline.h>
 #include <lib/kcon.h>
 #include <lib/lock.h>
+#include <ninex/condvar.h>
 #include <ninex/irq.h>
+#include <ninex/ktimer.h>
 #include <ninex/sched.h>
 #include <vm/vm.h>
 
-static struct threadlist threadq;
+// Ticks between attempts at evening out the runqueues of all CPUs
+#define BALANCE_INTERVAL 5
+
+// Every runnable thread should get a turn within SCHED_LATENCY, unless there
+// are so many that it would leave them with less than SCHED_MIN_GRAN each
+#define SCHED_LATENCY (DEFAULT_TIMESLICE * 1000000UL)
+#define SCHED_MIN_GRAN 4000000UL
+#define NICE_0_WEIGHT 1024
+
+// How long SCHED_RR threads run before making way for others of the same
+// priority, in milliseconds
+#define RR_TIMESLICE 100
+
+// Dead threads the reaper frees in one go, before checking for more
+#define REAP_BATCH 16
+
+// Each CPU schedules out of its own runqueue, only looking at the others to
+// steal work when it runs dry (or every BALANCE_INTERVAL ticks, to even
+// them out). Threads are never moved while their stack is in use.
+//
+// The tick only runs while there's something to share the CPU with, so idle
+// CPUs (and those with a single runnable thread) have it stopped, and get
+// kicked with an IPI once that changes (see sched_queue).
+//
+// Threads only ever get queued (or stolen) onto CPUs in their affinity mask,
+// and isolated CPUs stay out of balancing entirely, so they only run the
+// threads that were pinned onto them.
+//
+// Real-time threads wait in a FIFO per priority, with a bitmap of the ones
+// that aren't empty, and always run first. Everything else is sorted by
+// vruntime, and the one that's furthest behind runs next, for a slice that's
+// proportional to its weight.
+struct runqueue {
+  lock_t lock;
+  struct threadlist rt_queues[RT_PRIO_MAX + 1];
+  uint64_t rt_bitmap[2];
+  struct rb_tree threads;
+  uint64_t min_vruntime;  // Only ever moves forward, see place_thread
+  uint64_t load;          // Sum of the weights of all queued fair threads
+  size_t nr_queued;
+  thread_t *curr, *idle;
+  uint32_t ticks;
+  int cpu;
+  bool ready, tick_stopped;
+};
+
+// Each nice level is worth ~10% of CPU time compared to the next one, which
+// works out to a factor of ~1.25 between their weights
+static const uint32_t nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548,  7620,  6100,  4904,  3906,
+    /*  -5 */ 3121,  2501,  1991,  1586,  1277,
+    /*   0 */ 1024,  820,   655,   526,   423,
+    /*   5 */ 335,   272,   215,   172,   137,
+    /*  10 */ 110,   87,    70,    56,    45,
+    /*  15 */ 36,    29,    23,    18,    15,
+};
+
+static DEFINE_PERCPU(struct runqueue, runqueue);
 static struct threadlist deadq;
-static lock_t queue_lock;
+static lock_t dead_lock;
+static thread_t *reaper;
+static cpumask_t isolated_cpus;
 int resched_slot = 0;
 
+#define this_rq this_cpu_ptr(runqueue)
+#define cpu_rq(cpu) per_cpu_ptr(runqueue, cpu)
+
+#define thread_weight(t) (nice_to_weight[(t)->nice - NICE_MIN])
+#define rq_thread(n) rb_entry(n, thread_t, run_node)
+#define is_rt(t) ((t)->policy != SCHED_OTHER)
+
+static void rq_setup(int cpu) {
+  struct runqueue *rq = cpu_rq(cpu);
+  if (rq->ready) return;
+
+  for (int i = 0; i <= RT_PRIO_MAX; i++)
+    TAILQ_INIT(&rq->rt_queues[i]);
+
+  rq->threads = (struct rb_tree){0};
+  rq->cpu = cpu;
+  ATOMIC_WRITE(&rq->ready, true);
+}
+
+// Returns the runqueue of 'cpu', or NULL if it isn't scheduling yet
+static struct runqueue *ready_rq(int cpu) {
+  if (cpu_locals[cpu] == NULL) return NULL;
+
+  struct runqueue *rq = cpu_rq(cpu);
+  return ATOMIC_READ(&rq->ready) ? rq : NULL;
+}
+
+// Checks if 'thread' may run on 'cpu', where threads that weren't pinned
+// anywhere run on all but the isolated CPUs
+static bool cpu_allowed(thread_t *thread, int cpu) {
+  if (cpumask_empty(&thread->affinity))
+    return !cpumask_test(&isolated_cpus, cpu);
+
+  return cpumask_test(&thread->affinity, cpu);
+}
+
+// Parses the 'isolcpus' cmdline option, which is a list of CPUs (or ranges
+// of them) to keep out of general scheduling, like 'isolcpus=1,4-7'
+static void parse_isolcpus() {
+  const char *list = cmdline_get("isolcpus");
+  if (list == NULL) return;
+
+  while (*list != '\0') {
+    char *end;
+    uint32_t first = strtol(list, &end, 10), last = first;
+    if (end != list && *end == '-') last = strtol(end + 1, &end, 10);
+
+    if (end == list || (*end != ',' && *end != '\0') || first > last ||
+        last >= VM_MAX_CPUS) {
+      klog("sched: ignoring malformed 'isolcpus' option");
+      isolated_cpus = (cpumask_t){0};
+      return;
+    }
+
+    for (uint32_t cpu = first; cpu <= last; cpu++)
+      cpumask_set(&isolated_cpus, cpu);
+
+    list = (*end == ',') ? end + 1 : end;
+  }
+}
+
+// Returns the highest priority with queued real-time threads, or -1
+static int rt_highest(struct runqueue *rq) {
+  if (rq->rt_bitmap[1]) return 127 - __builtin_clzl(rq->rt_bitmap[1]);
+  if (rq->rt_bitmap[0]) return 63 - __builtin_clzl(rq->rt_bitmap[0]);
+
+  return -1;
+}
+
+// Compares vruntimes in a way that survives them wrapping around
+static bool vruntime_before(struct rb_node *a, struct rb_node *b) {
+  return (int64_t)(rq_thread(a)->vruntime - rq_thread(b)->vruntime) < 0;
+}
+
+// Queues a thread, where 'head' puts a real-time thread in front of others
+// of the same priority (fair threads are always sorted by vruntime)
+static void rq_add(struct runqueue *rq, thread_t *thread, bool head) {
+  if (is_rt(thread)) {
+    int prio = thread->rt_priority;
+    if (head)
+      TAILQ_INSERT_HEAD(&rq->rt_queues[prio], thread, queue);
+    else
+      TAILQ_INSERT_TAIL(&rq->rt_queues[prio], thread, queue);
+
+    rq->rt_bitmap[prio / 64] |= (1UL << (prio % 64));
+  } else {
+    rb_insert(&rq->threads, &thread->run_node, vruntime_before);
+    rq->load += thread_weight(thread);
+  }
+
+  thread->queued = true;
+  ATOMIC_INC(&rq->nr_queued);
+}
+
+static void rq_remove(struct runqueue *rq, thread_t *thread) {
+  if (is_rt(thread)) {
+    int prio = thread->rt_priority;
+    TAILQ_REMOVE(&rq->rt_queues[prio], thread, queue);
+
+    if (TAILQ_EMPTY(&rq->rt_queues[prio]))
+      rq->rt_bitmap[prio / 64] &= ~(1UL << (prio % 64));
+  } else {
+    rb_remove(&rq->threads, &thread->run_node);
+    rq->load -= thread_weight(thread);
+  }
+
+  thread->queued = false;
+  ATOMIC_DEC(&rq->nr_queued);
+}
+
+// Charges the thread for the time it spent running since 'exec_start'.
+// Returns true if it's a real-time thread that has some of its slice left,
+// and should therefore stay at the front of its queue.
+static bool account_thread(thread_t *thread, uint64_t now) {
+  // Other CPUs might charge us with a slightly skewed clock
+  uint64_t delta = (now > thread->exec_start) ? now - thread->exec_start : 0;
+  thread->exec_start = now;
+
+  switch (thread->policy) {
+    case SCHED_FIFO:
+      return true;
+    case SCHED_RR:
+      if (delta < thread->rt_remaining) {
+        thread->rt_remaining -= delta;
+        return true;
+      }
+
+      thread->rt_remaining = RR_TIMESLICE * 1000000UL;
+      return false;
+    default:
+      if (thread->nice != 0)
+        delta = (delta * NICE_0_WEIGHT) / thread_weight(thread);
+
+      thread->vruntime += delta;
+      return false;
+  }
+}
+
+// Whether waking 'thread' up should kick whatever 'rq' is running right away,
+// instead of waiting for the next tick
+static bool should_preempt(struct runqueue *rq, thread_t *thread) {
+  thread_t *curr = rq->curr;
+  if (curr == NULL) return rq->idle != NULL;  // Not scheduling yet
+  if (curr == rq->idle) return true;
+  if (!is_rt(thread)) return false;
+
+  return !is_rt(curr) || thread->rt_priority > curr->rt_priority;
+}
+
+static thread_t *pick_next(struct runqueue *rq) {
+  int prio = rt_highest(rq);
+  if (prio >= 0) return TAILQ_FIRST(&rq->rt_queues[prio]);
+
+  if (rb_empty(&rq->threads)) return NULL;
+  return rq_thread(rb_first(&rq->threads));
+}
+
+// Gives a thread that's about to be queued a vruntime close to that of the
+// others. New threads start right at the minimum, while those waking up get
+// a head start of half a period at most, so that sleeping for a long time
+// doesn't entitle them to hog the CPU afterwards.
+static void place_thread(struct runqueue *rq, thread_t *thread, bool new) {
+  uint64_t floor = rq->min_vruntime;
+  if (!new) floor -= SCHED_LATENCY / 2;
+
+  if (new || (int64_t)(thread->vruntime - floor) < 0)
+    thread->vruntime = floor;
+}
+
+// Moves 'min_vruntime' up to the lowest vruntime that's on this runqueue,
+// counting the thread that's running right now
+static void update_min_vruntime(struct runqueue *rq) {
+  thread_t *curr = rq->curr, *first = NULL;
+  if (!rb_empty(&rq->threads)) first = rq_thread(rb_first(&rq->threads));
+  if (curr == NULL || curr == rq->idle || is_rt(curr)) curr = NULL;
+
+  if (first == NULL && curr == NULL) return;
+
+  uint64_t vruntime = first ? first->vruntime : curr->vruntime;
+  if (curr != NULL && (int64_t)(curr->vruntime - vruntime) < 0)
+    vruntime = curr->vruntime;
+
+  if ((int64_t)(vruntime - rq->min_vruntime) > 0) rq->min_vruntime = vruntime;
+}
+
+// Brings the current thread's vruntime up to date, which only happens on
+// every reschedule otherwise (and those might be rare without a tick)
+static void update_curr(struct runqueue *rq) {
+  thread_t *curr = rq->curr;
+  if (curr != NULL && curr != rq->idle && !is_rt(curr))
+    account_thread(curr, timer_get_ns());
+
+  update_min_vruntime(rq);
+}
+
+// Splits up the scheduling period between 'thread' (which was just picked)
+// and everything still queued, according to their weights. FIFO threads run
+// until they block, though the tick keeps going for balancing.
+static uint64_t thread_slice(struct runqueue *rq, thread_t *thread) {
+  if (thread->policy == SCHED_FIFO)
+    return DEFAULT_TIMESLICE;
+  else if (thread->policy == SCHED_RR)
+    return MAX(DIV_ROUNDUP(thread->rt_remaining, 1000000UL), 1UL);
+
+  size_t nr_running = rq->nr_queued + 1;
+  uint64_t period = SCHED_LATENCY;
+  if (nr_running > SCHED_LATENCY / SCHED_MIN_GRAN)
+    period = nr_running * SCHED_MIN_GRAN;
+
+  uint64_t weight = thread_weight(thread);
+  uint64_t slice = (period * weight) / (rq->load + weight);
+
+  // The timer only goes down to milliseconds
+  return MAX(DIV_ROUNDUP(slice, 1000000UL), 1UL);
+}
+
+// Locks the runqueue that 'thread' belongs to, which might change under our
+// feet if another CPU steals the thread in the meantime
+static struct runqueue *lock_thread_rq(thread_t *thread, bool *irq) {
+  for (;;) {
+    struct runqueue *rq = cpu_rq(ATOMIC_READ(&thread->cpu));
+    *irq = spinlock_irq(&rq->lock);
+    if (rq->cpu == ATOMIC_READ(&thread->cpu)) return rq;
+
+    spinrelease_irq(&rq->lock, *irq);
+  }
+}
+
+// Runnable threads on a runqueue, including the one that's running
+static size_t nr_running(struct runqueue *rq) {
+  thread_t *curr = ATOMIC_READ(&rq->curr);
+  return ATOMIC_READ(&rq->nr_queued) + (curr != NULL && curr != rq->idle);
+}
+
+// Picks the CPU with the least work out of those 'thread' may run on,
+// preferring our own when there's a tie (or when none of them are up yet)
+static int idlest_cpu(thread_t *thread) {
+  int self = this_cpu_read(proc_id);
+  rq_setup(self);
+
+  struct runqueue *best = cpu_allowed(thread, self) ? this_rq : NULL;
+  for (int i = 0; i < VM_MAX_CPUS; i++) {
+    struct runqueue *rq = ready_rq(i);
+    if (rq == NULL || !cpu_allowed(thread, i)) continue;
+
+    if (best == NULL || nr_running(rq) < nr_running(best)) best = rq;
+  }
+
+  return (best != NULL) ? best->cpu : self;
+}
+
+// Wakes up some CPU that's idling with its tick stopped (other than 'cpu'),
+// so that it can steal the work that just got queued elsewhere
+static void kick_idle_cpu(int cpu) {
+  for (int i = 0; i < VM_MAX_CPUS; i++) {
+    struct runqueue *rq = ready_rq(i);
+    if (i == cpu || rq == NULL || cpumask_test(&isolated_cpus, i)) continue;
+
+    if (ATOMIC_READ(&rq->tick_stopped) && ATOMIC_READ(&rq->curr) == rq->idle) {
+      ic_send_ipi(IPI_SCHED_YIELD, cpu_locals[i]->lapic_id, IPI_SPECIFIC);
+      return;
+    }
+  }
+}
+
+// Moves a thread that isn't running anywhere from 'victim' over to 'rq'
+// (with both locked), carrying over how far ahead/behind it was relative to
+// the others if it's a fair one
+static bool migrate_thread(struct runqueue *rq,
+                           struct runqueue *victim,
+                           thread_t *thread) {
+  if (ATOMIC_READ(&thread->on_cpu) || !cpu_allowed(thread, rq->cpu))
+    return false;
+
+  rq_remove(victim, thread);
+  if (!is_rt(thread))
+    thread->vruntime += rq->min_vruntime - victim->min_vruntime;
+
+  ATOMIC_WRITE(&thread->cpu, rq->cpu);
+  rq_add(rq, thread, false);
+  return true;
+}
+
+// Moves up to 'count' threads from 'victim' over to 'rq' (whose lock is
+// held), giving up right away if 'victim' is busy
+static void steal_threads(struct runqueue *rq,
+                          struct runqueue *victim,
+                          size_t count) {
+  if (trylock(&victim->lock)) return;
+
+  // Real-time threads waiting over there are the ones that benefit most
+  for (int prio = rt_highest(victim); prio > 0 && count > 0; prio--) {
+    thread_t *thread = TAILQ_FIRST(&victim->rt_queues[prio]), *next;
+    for (; thread != NULL && count > 0; thread = next) {
+      next = TAILQ_NEXT(thread, queue);
+      if (migrate_thread(rq, victim, thread)) count--;
+    }
+  }
+
+  // Then take the fair threads that would've waited the longest
+  struct rb_node *node = rb_last(&victim->threads);
+  while (node != NULL && count > 0) {
+    thread_t *thread = rq_thread(node);
+    node = rb_prev(node);
+
+    if (migrate_thread(rq, victim, thread)) count--;
+  }
+
+  spinrelease(&victim->lock);
+}
+
+// Pulls work over from the busiest CPU, either a single thread if we've run
+// dry, or enough to even the two out otherwise
+static void balance(struct runqueue *rq) {
+  if (cpumask_test(&isolated_cpus, rq->cpu)) return;
+
+  struct runqueue *busiest = NULL;
+  for (int i = 0; i < VM_MAX_CPUS; i++) {
+    struct runqueue *cur = ready_rq(i);
+    if (cur == NULL || cur == rq || cpumask_test(&isolated_cpus, i)) continue;
+
+    if (busiest == NULL ||
+        ATOMIC_READ(&cur->nr_queued) > ATOMIC_READ(&busiest->nr_queued))
+      busiest = cur;
+  }
+
+  if (busiest == NULL) return;
+
+  size_t theirs = ATOMIC_READ(&busiest->nr_queued);
+  if (rq->nr_queued == 0 && theirs > 0)
+    steal_threads(rq, busiest, 1);
+  else if (theirs >= rq->nr_queued + 2)
+    steal_threads(rq, busiest, (theirs - rq->nr_queued) / 2);
+}
+
 void sched_queue(thread_t *thread) {
-  spinlock(&queue_lock);
+  // New threads go wherever there's the least work
+  bool new = (thread->cpu < 0);
+  if (new) thread->cpu = idlest_cpu(thread);
+
+  bool irq, preempt = false, busy = false;
+  struct runqueue *rq = lock_thread_rq(thread, &irq);
   thread->no_queue = false;
-  TAILQ_INSERT_TAIL(&threadq, thread, queue);
-  spinrelease(&queue_lock);
+
+  // Threads that aren't allowed here anymore move over to the idlest CPU
+  // they're allowed on, keeping their vruntime relative to the runqueue
+  if (!thread->queued && rq->curr != thread && !cpu_allowed(thread, rq->cpu)) {
+    thread->vruntime -= rq->min_vruntime;
+    ATOMIC_WRITE(&thread->cpu, idlest_cpu(thread));
+    spinrelease_irq(&rq->lock, irq);
+
+    rq = lock_thread_rq(thread, &irq);
+    if (!thread->queued && rq->curr != thread)
+      thread->vruntime += rq->min_vruntime;
+  }
+
+  // A thread that's still running gets requeued by reschedule instead. If
+  // the CPU went tickless, it has to be kicked for the newcomer to ever get
+  // a turn (unless another CPU steals it first).
+  if (!thread->queued && rq->curr != thread) {
+    if (!is_rt(thread)) {
+      update_curr(rq);
+      place_thread(rq, thread, new);
+    }
+
+    rq_add(rq, thread, false);
+    preempt = should_preempt(rq, thread) || rq->tick_stopped;
+    busy = (rq->curr != NULL && rq->curr != rq->idle);
+  }
+
+  int cpu = thread->cpu;
+  spinrelease_irq(&rq->lock, irq);
+
+  if (preempt && cpu_locals[cpu] != NULL)
+    ic_send_ipi(IPI_SCHED_YIELD, cpu_locals[cpu]->lapic_id, IPI_SPECIFIC);
+  if (busy) kick_idle_cpu(cpu);
 }
 
 void sched_dequeue(thread_t *thread) {
-  spinlock(&queue_lock);
+  if (thread->cpu < 0) return;
 
-  if (this_cpu->cur_thread == thread) {
+  bool irq;
+  struct runqueue *rq = lock_thread_rq(thread, &irq);
+
+  if (thread->queued) {
+    rq_remove(rq, thread);
+  } else {
     // An active thread can't be queue'd, so just
     // mark it as unqueueable
     thread->no_queue = true;
-  } else {
-    TAILQ_REMOVE(&threadq, thread, queue);
   }
 
-  spinrelease(&queue_lock);
+  spinrelease_irq(&rq->lock, irq);
+}
+
+void sched_set_nice(thread_t *thread, int nice) {
+  nice = MIN(MAX(nice, NICE_MIN), NICE_MAX);
+  if (thread->cpu < 0) {
+    thread->nice = nice;
+    return;
+  }
+
+  // Queued threads have their weight added into the runqueue's load, which
+  // has to be kept in sync
+  bool irq;
+  struct runqueue *rq = lock_thread_rq(thread, &irq);
+  bool queued = thread->queued && !is_rt(thread);
+
+  if (queued) rq->load -= thread_weight(thread);
+  thread->nice = nice;
+  if (queued) rq->load += thread_weight(thread);
+
+  spinrelease_irq(&rq->lock, irq);
+}
+
+bool sched_policy_valid(int policy, int priority) {
+  if (policy == SCHED_OTHER)
+    return (priority == 0);
+  else if (policy == SCHED_FIFO || policy == SCHED_RR)
+    return (priority >= 1 && priority <= RT_PRIO_MAX);
+
+  return false;
+}
+
+bool sched_set_policy(thread_t *thread, int policy, int priority) {
+  if (!sched_policy_valid(policy, priority)) return false;
+  if (thread->cpu < 0) {
+    thread->policy = policy;
+    thread->rt_priority = priority;
+    thread->rt_remaining = RR_TIMESLICE * 1000000UL;
+    return true;
+  }
+
+  // Requeue the thread, since it has to move between queues
+  bool irq, preempt = false;
+  struct runqueue *rq = lock_thread_rq(thread, &irq);
+  bool queued = thread->queued, was_rt = is_rt(thread);
+  if (queued) rq_remove(rq, thread);
+
+  thread->policy = policy;
+  thread->rt_priority = priority;
+  thread->rt_remaining = RR_TIMESLICE * 1000000UL;
+
+  // The vruntime of former real-time threads is long out of date
+  if (was_rt && !is_rt(thread)) place_thread(rq, thread, true);
+
+  if (queued) {
+    rq_add(rq, thread, false);
+    preempt = should_preempt(rq, thread);
+  }
+
+  int cpu = thread->cpu;
+  spinrelease_irq(&rq->lock, irq);
+
+  if (preempt && cpu_locals[cpu] != NULL)
+    ic_send_ipi(IPI_SCHED_YIELD, cpu_locals[cpu]->lapic_id, IPI_SPECIFIC);
+
+  return true;
+}
+
+void sched_inherit(thread_t *child, thread_t *parent) {
+  child->nice = parent->nice;
+  child->policy = parent->policy;
+  child->rt_priority = parent->rt_priority;
+  child->rt_remaining = RR_TIMESLICE * 1000000UL;
+  child->affinity = parent->affinity;
+}
+
+bool sched_affinity_valid(cpumask_t *mask) {
+  // There has to be somewhere left for the thread to run
+  for (int i = 0; i < VM_MAX_CPUS; i++)
+    if (cpumask_test(mask, i) && ready_rq(i) != NULL) return true;
+
+  return false;
+}
+
+bool sched_set_affinity(thread_t *thread, cpumask_t *mask) {
+  if (!sched_affinity_valid(mask)) return false;
+  if (thread->cpu < 0) {
+    thread->affinity = *mask;
+    return true;
+  }
+
+  // Queued threads are moved right away, while running ones get preempted,
+  // and moved by reschedule once they're off the CPU
+  bool irq, requeue = false, preempt = false;
+  struct runqueue *rq = lock_thread_rq(thread, &irq);
+  thread->affinity = *mask;
+
+  if (!cpumask_test(mask, rq->cpu)) {
+    if (thread->queued) {
+      rq_remove(rq, thread);
+      requeue = true;
+    } else if (rq->curr == thread) {
+      preempt = true;
+    }
+  }
+
+  int cpu = rq->cpu;
+  spinrelease_irq(&rq->lock, irq);
+
+  if (requeue) {
+    sched_queue(thread);
+  } else if (preempt && cpu == this_cpu_read(proc_id)) {
+    sched_yield();
+  } else if (preempt && cpu_locals[cpu] != NULL) {
+    ic_send_ipi(IPI_SCHED_YIELD, cpu_locals[cpu]->lapic_id, IPI_SPECIFIC);
+  }
+
+  return true;
+}
+
+void sched_get_affinity(thread_t *thread, cpumask_t *mask) {
+  *mask = (cpumask_t){0};
+  for (int i = 0; i < VM_MAX_CPUS; i++)
+    if (ready_rq(i) != NULL && cpu_allowed(thread, i)) cpumask_set(mask, i);
 }
 
 void sched_yield() {
+  // Switch away right here, instead of waiting on the timer to do it. The
+  // thread resumes with interrupts still off, so turn them back on after.
   asm volatile("cli");
-  timer_stop();
-  this_cpu->yielded = 1;
-  timer_oneshot(1, resched_slot);
-  asm volatile("sti");
-
-  while (this_cpu->yielded)
-    asm volatile("hlt");
+  this_cpu_write(yielded, 1);
+  asm volatile("int %0\n\tsti" ::"i"(SOFTINT_SCHED_YIELD) : "memory");
 }
 
 void sched_dequeue_and_yield() {
   asm volatile("cli");
-  sched_dequeue(this_cpu->cur_thread);
+  sched_dequeue(this_cpu_read(cur_thread));
+  sched_yield();
+}
+
+static void wake_sleeper(struct ktimer *timer) {
+  sched_queue(timer->data);
+}
+
+void thread_sleep_until(uint64_t deadline) {
+  thread_t *self = this_cpu_read(cur_thread);
+  ktimer_init(&self->sleep_timer, wake_sleeper, self);
+
+  // The timer can't go off before we're off the runqueue, since it's armed
+  // on this CPU, which doesn't take interrupts until it yields
+  asm volatile("cli");
+  if (deadline <= timer_get_ns()) {
+    asm volatile("sti");
+    return;
+  }
+
+  sched_dequeue(self);
+  ktimer_arm(&self->sleep_timer, deadline);
   sched_yield();
+
+  // Anything else that woke us up leaves the timer behind
+  ktimer_cancel(&self->sleep_timer);
 }
 
 void sched_die(thread_t *target) {
-  if (target == NULL) target = this_cpu->cur_thread;
+  thread_t *self = this_cpu_read(cur_thread);
+  if (target == NULL) target = self;
 
   asm volatile("cli");
+  ktimer_cancel(&target->sleep_timer);
+  cv_cancel_wait(target);
   sched_dequeue(target);
 
-  // Add the thread to the dead-list, so that the janitor
-  // can clean up the resources it occupies
+  // Add the thread to the dead-list, and wake up the reaper, so that it can
+  // clean up the resources it occupies
+  spinlock(&dead_lock);
   TAILQ_INSERT_TAIL(&deadq, target, queue);
-  if (target == this_cpu->cur_thread) sched_yield();
+  spinrelease(&dead_lock);
+  if (reaper != NULL) sched_queue(reaper);
+
+  // Threads running on another CPU get kicked off of it right away
+  int cpu = ATOMIC_READ(&target->cpu);
+  if (target == self)
+    sched_yield();
+  else if (ATOMIC_READ(&target->on_cpu) && cpu_locals[cpu] != NULL)
+    ic_send_ipi(IPI_SCHED_YIELD, cpu_locals[cpu]->lapic_id, IPI_SPECIFIC);
+}
+
+// Frees the threads that sched_die left behind, in batches. It sleeps while
+// there are none, and since it only goes to sleep with 'dead_lock' held,
+// sched_die can't miss it.
+static void reaper_thread() {
+  for (;;) {
+    struct threadlist batch;
+    TAILQ_INIT(&batch);
+
+    asm volatile("cli");
+    spinlock(&dead_lock);
+    if (TAILQ_EMPTY(&deadq)) {
+      sched_dequeue(reaper);
+      spinrelease(&dead_lock);
+      sched_yield();
+      continue;
+    }
 
-  // TODO: do an IPI if a CPU is running this thread (that's not us)
+    for (int i = 0; i < REAP_BATCH && !TAILQ_EMPTY(&deadq); i++) {
+      thread_t *thread = TAILQ_FIRST(&deadq);
+      TAILQ_REMOVE(&deadq, thread, queue);
+      TAILQ_INSERT_TAIL(&batch, thread, queue);
+    }
+
+    spinrelease(&dead_lock);
+    asm volatile("sti");
+
+    // Threads that just died might still be on their way off the CPU
+    thread_t *thread;
+    while ((thread = TAILQ_FIRST(&batch)) != NULL) {
+      TAILQ_REMOVE(&batch, thread, queue);
+      while (ATOMIC_READ(&thread->on_cpu))
+        sched_yield();
+
+      thread_destroy(thread);
+    }
+  }
+}
+
+static void idle_thread() {
+  for (;;)
+    asm volatile("sti; hlt");
 }
 
 void reschedule(struct cpu_context *ctx) {
@@ -68,45 +704,76 @@ void reschedule(struct cpu_context *ctx) {
   if (ctx->cs & 3) asm_swapgs();
 #endif  // __x86_64__
 
-  if (trylock(&queue_lock)) {
-    timer_oneshot(DEFAULT_TIMESLICE, resched_slot);
-#ifdef __x86_64__
-    if (ctx->cs & 3) asm_swapgs();
-#endif  // __x86_64__
-
-    return;
-  }
+  struct runqueue *rq = this_rq;
+  uint64_t now = timer_get_ns();
+  ktimer_run(now);
+  spinlock(&rq->lock);
+  bool yielded = this_cpu_read(yielded);
+  this_cpu_write(yielded, 0);
 
-  ATOMIC_WRITE(&this_cpu->yielded, 0);
-  if (this_cpu->cur_thread != NULL) {
+  // Real-time threads that got preempted keep their spot, unless they gave
+  // it up themselves. Threads that aren't allowed here anymore get pushed
+  // over to another CPU instead, once our lock is dropped.
+  thread_t *prev = this_cpu_read(cur_thread);
+  bool push = false;
+  if (prev != NULL) {
     cpu_save_thread(ctx);
-    if (!this_cpu->cur_thread->no_queue)
-      TAILQ_INSERT_TAIL(&threadq, this_cpu->cur_thread, queue);
 
-    this_cpu->cur_thread = NULL;
+    if (prev != rq->idle) {
+      bool head = account_thread(prev, now) && !yielded;
+      if (!cpu_allowed(prev, rq->cpu))
+        push = !prev->no_queue;
+      else if (!prev->no_queue)
+        rq_add(rq, prev, head);
+    }
   }
 
-  thread_t *cur_thread = NULL;
-  if (!TAILQ_EMPTY(&threadq)) {
-    cur_thread = TAILQ_FIRST(&threadq);
-    this_cpu->cur_thread = cur_thread;
-    TAILQ_REMOVE(&threadq, cur_thread, queue);
-  }
+  // Look for work elsewhere when there's none left here, and every once in
+  // a while regardless
+  if (rq->nr_queued == 0 || (++rq->ticks % BALANCE_INTERVAL) == 0)
+    balance(rq);
+
+  update_min_vruntime(rq);
 
-  if (cur_thread == NULL) {
+  // Idle on whatever space is loaded, since switching to the kernel's
+  // would only cost the next thread a TLB refill. There's no need for a tick
+  // unless someone is left waiting (or a timer is due), since anything that
+  // gets queued later kicks us anyways.
+  uint64_t slice = 0;
+  thread_t *next = pick_next(rq);
+  if (next != NULL) {
+    rq_remove(rq, next);
+    next->exec_start = now;
+    if (rq->nr_queued > 0) slice = thread_slice(rq, next);
+  } else if (rq->idle != NULL) {
+    next = rq->idle;
+  } else {
+    // Early on there's no idle thread yet, so wait for the next tick
+    this_cpu_write(cur_thread, NULL);
+    rq->curr = NULL;
     timer_oneshot(DEFAULT_TIMESLICE, resched_slot);
-    vm_space_load(&kernel_space);
-    this_cpu->cur_spc = &kernel_space;
-    spinrelease(&queue_lock);
+    spinrelease(&rq->lock);
+    if (push) sched_queue(prev);
 
     asm("sti");
     for (;;)
       asm("hlt");
   }
 
-  spinrelease(&queue_lock);
-  timer_oneshot(DEFAULT_TIMESLICE, resched_slot);
-  cpu_restore_thread(ctx);
+  // Threads pushed over from another CPU might still be on their way off
+  // of it, and their stack can't be shared
+  while (next != prev && ATOMIC_READ(&next->on_cpu))
+    asm volatile("pause");
+
+  next->on_cpu = true;
+  this_cpu_write(cur_thread, next);
+  rq->curr = next;
+  rq->tick_stopped = (slice == 0);
+  spinrelease(&rq->lock);
+  if (push) sched_queue(prev);
+
+  ktimer_program(now, slice);
+  cpu_restore_thread(ctx, prev);
 }
 
 void enter_scheduler() {
@@ -116,8 +783,27 @@ void enter_scheduler() {
     res->procfs_name = "scheduler";
     res->eoi_strategy = EOI_MODE_TIMER;
 
-    TAILQ_INIT(&threadq);
     TAILQ_INIT(&deadq);
+    parse_isolcpus();
+  }
+
+  rq_setup(this_cpu_read(proc_id));
+
+  // Every CPU gets a thread to run when there's nothing else to do (which
+  // never sits in a runqueue). Those are kernel threads, which can't be
+  // created until the BSP gets here, since the APs enter during SMP startup.
+  for (int i = 0; kernel_process != NULL && i < VM_MAX_CPUS; i++) {
+    struct runqueue *rq = ready_rq(i);
+    if (rq == NULL || rq->idle != NULL) continue;
+
+    thread_t *idle = kthread_create((uintptr_t)idle_thread, 0);
+    idle->cpu = i;
+    ATOMIC_WRITE(&rq->idle, idle);
+  }
+
+  if (kernel_process != NULL && reaper == NULL) {
+    reaper = kthread_create((uintptr_t)reaper_thread, 0);
+    sched_queue(reaper);
   }
 
   // Wait for the BSP, then start the timer...
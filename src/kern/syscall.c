@@ -1,12 +1,15 @@
 #include <arch/arch.h>
 #include <arch/hat.h>
 #include <arch/smp.h>
+#include <arch/timer.h>
 #include <fs/vfs.h>
 #include <lib/builtin.h>
 #include <lib/errno.h>
 #include <lib/kcon.h>
+#include <lib/vec.h>
 #include <ninex/sched.h>
 #include <ninex/syscall.h>
+#include <vm/cache.h>
 #include <vm/seg.h>
 
 ////////////////////////
@@ -16,40 +19,78 @@ static void stubcall(cpu_ctx_t *context) {
   PANIC(NULL, "syscall: call %d is a stub!\n", CALLNUM(context));
 }
 
-// This function is implmented really badly, so I need to
-// find a better way to get the job done
+// Copies a NULL-terminated usermode string, returning NULL (with errno set)
+// if it faults or is longer than a page
 static char *user_strdup(uintptr_t str) {
-  mg_disable();
-  int str_length = strlen((char *)str);
-  mg_enable();
+  char *result = kmalloc(VM_PAGE_SIZE);
+  ssize_t length = strncpy_from_user(result, (char *)str, VM_PAGE_SIZE);
 
-  char *result = kmalloc(str_length);
-  mg_copy_from_user(result, (void *)str, str_length);
-  return result;
+  if (length < 0 || length == VM_PAGE_SIZE) {
+    set_errno((length < 0) ? EFAULT : ENAMETOOLONG);
+    kfree(result);
+    return NULL;
+  }
+
+  return krealloc(result, length + 1);
+}
+
+// Duplicates a NULL-terminated array of usermode strings (like argv/envp)
+static char **user_strvec_dup(uintptr_t vec) {
+  size_t count = 0;
+  vec_t(char *) result;
+  vec_init(&result);
+
+  for (;; count++) {
+    uintptr_t str;
+    if (!copy_from_user(&str, (uintptr_t *)vec + count, sizeof(uintptr_t))) {
+      set_errno(EFAULT);
+      goto fail;
+    } else if (str == 0) {
+      break;
+    }
+
+    char *copy = user_strdup(str);
+    if (copy == NULL) goto fail;
+    vec_push(&result, copy);
+  }
+
+  vec_push(&result, NULL);
+  return result.data;
+
+fail:
+  for (int i = 0; i < result.length; i++) kfree(result.data[i]);
+  vec_deinit(&result);
+  return NULL;
+}
+
+static void free_strvec(char **vec) {
+  for (char **cur = vec; *cur; cur++) kfree(*cur);
+  kfree(vec);
 }
 
 // Small macro for writing to a usermode pointer
-#define sc_write(pointer, data, type)                     \
-  ({                                                      \
-    if (!mg_validate((uintptr_t)pointer, sizeof(type))) { \
-      set_errno(EFAULT);                                  \
-      return;                                             \
-    }                                                     \
-    mg_disable();                                         \
-    *((type *)pointer) = (type)data;                      \
-    mg_enable();                                          \
+#define sc_write(pointer, data, type)                             \
+  ({                                                              \
+    type __value = (type)data;                                    \
+    if (!copy_to_user((void *)pointer, &__value, sizeof(type))) { \
+      set_errno(EFAULT);                                          \
+      return;                                                     \
+    }                                                             \
   })
 
+// The process making the syscall
+#define cur_proc (this_cpu_read(cur_thread)->parent)
+
 // Another small macro to help with fd to handle conversion
-#define openfd(fd)                                                 \
-  ({                                                               \
-    struct handle *result = (struct handle *)htab_find(            \
-        &this_cpu->cur_thread->parent->handles, &fd, sizeof(int)); \
-    if (result == NULL) {                                          \
-      set_errno(EBADF);                                            \
-      return;                                                      \
-    }                                                              \
-    result;                                                        \
+#define openfd(fd)                                                        \
+  ({                                                                      \
+    struct handle *result =                                               \
+        (struct handle *)htab_find(&cur_proc->handles, &fd, sizeof(int)); \
+    if (result == NULL) {                                                 \
+      set_errno(EBADF);                                                   \
+      return;                                                             \
+    }                                                                     \
+    result;                                                               \
   })
 
 /////////////////////////////
@@ -83,15 +124,26 @@ static void sys_vm_map(cpu_ctx_t *context) {
   size_t size = ARG2(context);
   uintptr_t hint = ARG5(context);
 
-  if (!(GET_FLAGS(flg) & MAP_ANON)) {
-    klog("syscall: vnode mappings aren't supported!");
-    set_errno(ENOTSUP);
-    sc_write(window, ((uintptr_t)-1), uintptr_t);
-    return;
+  struct vm_seg *result = NULL;
+  if (GET_FLAGS(flg) & MAP_ANON) {
+    result = vm_create_seg(GET_FLAGS(flg), GET_PROT(flg), size, hint);
+  } else {
+    // File mappings need a readable handle, which also has to be writable
+    // for writes to be carried through to the file
+    int fd = ARG3(context);
+    struct handle *hnd = openfd(fd);
+    if (!CAN_READ(hnd->flags) ||
+        ((GET_FLAGS(flg) & MAP_SHARED) && (GET_PROT(flg) & PROT_WRITE) &&
+         !CAN_WRITE(hnd->flags))) {
+      set_errno(EACCES);
+      sc_write(window, ((uintptr_t)-1), uintptr_t);
+      return;
+    }
+
+    result = vm_create_seg(GET_FLAGS(flg), GET_PROT(flg), size, hnd->node,
+                           (size_t)ARG4(context), hint);
   }
 
-  struct vm_seg *result =
-      vm_create_seg(GET_FLAGS(flg), GET_PROT(flg), size, hint);
   if (result) sc_write(window, result->base, void *);
   else
     sc_write(window, ((uintptr_t)-1), uintptr_t);
@@ -106,14 +158,40 @@ static void sys_vm_unmap(cpu_ctx_t *context) {
     return;
   }
 
+  vm_space_t *space = cur_proc->space;
+  bool irq = vm_space_lock(space);
+
   uint64_t offset;
   struct vm_seg *sg = vm_find_seg(ptr, &offset);
-  if (sg == NULL) {
+  if (sg == NULL || !sg->ops.unmap(sg, ptr, len)) set_errno(EINVAL);
+
+  vm_space_unlock(space, irq);
+}
+
+static void sys_vm_protect(cpu_ctx_t *context) {
+  uintptr_t ptr = ARG0(context);
+  size_t len = ARG1(context);
+  int prot = ARG2(context);
+
+  if (len == 0 || (ptr % cur_config->page_size != 0) ||
+      (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))) {
     set_errno(EINVAL);
     return;
   }
 
-  if (!sg->ops.unmap(sg, ptr, len)) set_errno(EINVAL);
+  vm_seg_protect(ptr, ALIGN_UP(len, cur_config->page_size), prot);
+}
+
+static void sys_vm_advise(cpu_ctx_t *context) {
+  uintptr_t ptr = ARG0(context);
+  size_t len = ARG1(context);
+
+  if (len == 0 || (ptr % cur_config->page_size != 0)) {
+    set_errno(EINVAL);
+    return;
+  }
+
+  vm_seg_advise(ptr, ALIGN_UP(len, cur_config->page_size), ARG2(context));
 }
 
 static void sys_open(cpu_ctx_t *context) {
@@ -121,7 +199,6 @@ static void sys_open(cpu_ctx_t *context) {
   mode_t mode = ARG2(context);
   char *path = user_strdup(ARG0(context));
   if (path == NULL) {
-    set_errno(EINVAL);
     sc_write(ARG3(context), -1, int);
     return;
   }
@@ -130,24 +207,39 @@ static void sys_open(cpu_ctx_t *context) {
   // therefore, assume O_RDWR when flags are 0
   if (flags == 0) flags = O_RDWR;
 
-  struct handle *hnd =
-      handle_open(this_cpu->cur_thread->parent, path, flags, mode);
+  struct handle *hnd = handle_open(cur_proc, path, flags, mode);
   if (hnd == NULL) {
     sc_write(ARG3(context), -1, int);
     goto finished;
   }
 
-  int fd = this_cpu->cur_thread->parent->fd_counter++;
+  int fd = cur_proc->fd_counter++;
   sc_write(ARG3(context), fd, int);
-  htab_insert(&this_cpu->cur_thread->parent->handles, &fd, sizeof(int), hnd);
+  htab_insert(&cur_proc->handles, &fd, sizeof(int), hnd);
 
 finished:
   kfree(path);
   return;
 }
 
+// File data goes through a kernel bounce buffer, instead of letting the
+// filesystem touch the usermode buffer (and fault on it) directly. Each
+// thread allocates its own the first time it needs one, and keeps it until
+// it exits, since filesystems might block (so it can't be per-CPU).
+#define SC_BOUNCE_SIZE (16 * VM_PAGE_SIZE)
+
+static void *sc_bounce() {
+  thread_t *self = this_cpu_read(cur_thread);
+  if (self->bounce == NULL) self->bounce = kmalloc(SC_BOUNCE_SIZE);
+
+  if (self->bounce == NULL) set_errno(ENOMEM);
+  return self->bounce;
+}
+
 static void sys_read(cpu_ctx_t *context) {
   struct handle *result = openfd(ARG0(context));
+  char *buffer = (char *)ARG1(context);
+  size_t length = ARG2(context);
 
   if (!CAN_READ(result->flags)) {
     set_errno(EINVAL);
@@ -155,22 +247,41 @@ static void sys_read(cpu_ctx_t *context) {
   }
 
   // Validate the pointer to the buffer
-  if (!mg_validate(ARG1(context), ARG2(context))) {
-    set_errno(EINVAL);
+  if (length && !mg_validate(ARG1(context), length)) {
+    set_errno(EFAULT);
     return;
-  } else {
-    mg_disable();  // Disable SMAP/PAN instead of using a scratch buffer
   }
 
-  size_t bytes_read = result->node->read(result->node, (void *)ARG1(context),
-                                         result->offset, ARG2(context));
-  result->offset += bytes_read;
+  void *bounce = sc_bounce();
+  if (bounce == NULL) return;
+
+  ssize_t bytes_read = 0;
+  while ((size_t)bytes_read < length) {
+    size_t chunk = MIN(length - bytes_read, (size_t)SC_BOUNCE_SIZE);
+    ssize_t count = result->node->read(result->node, bounce,
+                                       result->offset, chunk);
+    if (count <= 0) {
+      if (bytes_read == 0) bytes_read = count;
+      break;
+    }
+
+    if (!copy_to_user(buffer + bytes_read, bounce, count)) {
+      set_errno(EFAULT);
+      return;
+    }
+
+    result->offset += count;
+    bytes_read += count;
+    if ((size_t)count < chunk) break;
+  }
+
   sc_write(ARG3(context), bytes_read, size_t);
-  mg_enable();
 }
 
 static void sys_write(cpu_ctx_t *context) {
   struct handle *result = openfd(ARG0(context));
+  char *buffer = (char *)ARG1(context);
+  size_t length = ARG2(context);
 
   if (!CAN_WRITE(result->flags)) {
     set_errno(EINVAL);
@@ -178,18 +289,36 @@ static void sys_write(cpu_ctx_t *context) {
   }
 
   // Validate the pointer to the buffer
-  if (!mg_validate(ARG1(context), ARG2(context))) {
-    set_errno(EINVAL);
+  if (length && !mg_validate(ARG1(context), length)) {
+    set_errno(EFAULT);
     return;
-  } else {
-    mg_disable();
   }
 
-  size_t bytes_written = result->node->write(
-      result->node, (void *)ARG1(context), result->offset, ARG2(context));
-  result->offset += bytes_written;
+  void *bounce = sc_bounce();
+  if (bounce == NULL) return;
+
+  ssize_t bytes_written = 0;
+  while ((size_t)bytes_written < length) {
+    size_t chunk = MIN(length - bytes_written, (size_t)SC_BOUNCE_SIZE);
+    if (!copy_from_user(bounce, buffer + bytes_written, chunk)) {
+      set_errno(EFAULT);
+      return;
+    }
+
+    ssize_t count = result->node->write(result->node, bounce,
+                                        result->offset, chunk);
+    if (count <= 0) {
+      if (bytes_written == 0) bytes_written = count;
+      break;
+    }
+
+    vm_cache_update(result->node, bounce, result->offset, count);
+    result->offset += count;
+    bytes_written += count;
+    if ((size_t)count < chunk) break;
+  }
+
   sc_write(ARG3(context), bytes_written, size_t);
-  mg_enable();
 }
 
 #define SEEK_SET 0
@@ -221,32 +350,35 @@ static void sys_close(cpu_ctx_t *context) {
   result->node->close(result->node);
   result->refcount--;
 
-  htab_delete(&this_cpu->cur_thread->parent->handles, &ARG0(context),
-              sizeof(int));
+  htab_delete(&cur_proc->handles, &ARG0(context), sizeof(int));
   if (result->refcount == 0) kfree(result);
 }
 
 static void sys_get_pid(cpu_ctx_t *context) {
-  sc_write(ARG0(context), this_cpu->cur_thread->parent->pid, pid_t);
+  sc_write(ARG0(context), cur_proc->pid, pid_t);
 }
 
 static void sys_get_ppid(cpu_ctx_t *context) {
-  sc_write(ARG0(context), this_cpu->cur_thread->parent->ppid, pid_t);
+  sc_write(ARG0(context), cur_proc->ppid, pid_t);
 }
 
 static void sys_exit(cpu_ctx_t *context) {
   int status = (int)ARG0(context);
-  proc_t *process = this_cpu->cur_thread->parent;
+  proc_t *process = cur_proc;
 
   // Disable interrupts, so that the scheduler doesn't return us
   asm volatile("cli");
 
-  // Start by stopping all threads associated with this process
-  for (int i = 0; i < process->threads.length; i++) {
-    if (process->threads.data[i] == this_cpu->cur_thread) continue;
+  // Start by stopping all threads associated with this process, from the
+  // back, since the reaper might already be removing the ones we killed
+  // (which waits on the lock until we're done)
+  spinlock(&process->lock);
+  for (int i = process->threads.length - 1; i >= 0; i--) {
+    if (process->threads.data[i] == this_cpu_read(cur_thread)) continue;
 
     sched_die(process->threads.data[i]);
   }
+  spinrelease(&process->lock);
 
   // Next, close all file descriptors
   for (int i = 0; i < process->handles.capacity; i++) {
@@ -259,8 +391,12 @@ static void sys_exit(cpu_ctx_t *context) {
     if (hl->refcount == 0) kfree(hl);
   }
 
-  // Then switch to the kernel's space, and destroy the user's
+  // Then switch to the kernel's space, and destroy the user's (once nobody
+  // else can get to it)
+  spinlock(&process->lock);
   vm_space_t *proc_space = process->space;
+  process->space = NULL;
+  spinrelease(&process->lock);
   vm_space_load(&kernel_space);
   vm_space_destroy(proc_space);
 
@@ -276,12 +412,11 @@ static void sys_fcntl(cpu_ctx_t *context) {
 
   switch (ARG1(context)) {
     case F_DUPFD:
-      int new_fd = this_cpu->cur_thread->parent->fd_counter++;
+      int new_fd = cur_proc->fd_counter++;
       struct handle *new_hnd = kmalloc(sizeof(struct handle));
       sc_write(ARG3(context), new_fd, int);
       memcpy(new_hnd, hnd, sizeof(struct handle));
-      htab_insert(&this_cpu->cur_thread->parent->handles, &new_fd, sizeof(int),
-                  new_hnd);
+      htab_insert(&cur_proc->handles, &new_fd, sizeof(int), new_hnd);
       break;
     case F_SETFD:
       // Ignore, since we don't listen to CLOEXEC anyways
@@ -305,16 +440,13 @@ static void sys_ioctl(cpu_ctx_t *context) {
 }
 
 static void sys_getcwd(cpu_ctx_t *context) {
-  if (!mg_validate(ARG0(context), ARG1(context))) {
-    set_errno(EFAULT);
-    return;
-  }
+  char *result = vfs_get_path(cur_proc->cwd);
+  size_t length = strlen(result) + 1;
 
-  char *result = vfs_get_path(this_cpu->cur_thread->parent->cwd);
-  if (strlen(result) > ARG1(context)) {
+  if (length > ARG1(context)) {
     set_errno(ERANGE);
-  } else {
-    mg_copy_to_user((void *)ARG0(context), result, strlen(result));
+  } else if (!copy_to_user((void *)ARG0(context), result, length)) {
+    set_errno(EFAULT);
   }
 
   kfree(result);
@@ -322,38 +454,41 @@ static void sys_getcwd(cpu_ctx_t *context) {
 
 static void sys_stat(cpu_ctx_t *context) {
   struct stat *statbuf = (struct stat *)ARG1(context);
-  if (!mg_validate((uintptr_t)statbuf, sizeof(struct stat))) {
-    set_errno(EFAULT);
-    return;
-  }
+  struct stat *st;
 
   if (ARG0(context)) {
     // FD stat
     struct handle *hnd = openfd(ARG2(context));
-    mg_copy_to_user(statbuf, &hnd->node->st, sizeof(struct stat));
+    st = &hnd->node->st;
   } else {
     // File stat
     char *real_path = user_strdup(ARG2(context));
-    struct vfs_resolved_node res =
-        vfs_resolve(this_cpu->cur_thread->parent->cwd, real_path, 0);
+    if (real_path == NULL) return;
+
+    struct vfs_resolved_node res = vfs_resolve(cur_proc->cwd, real_path, 0);
+    kfree(res.raw_string);
+    kfree(real_path);
     if (!res.success) {
       set_errno(ENOENT);
       return;
     }
 
-    mg_copy_to_user(statbuf, &res.target->backing->st, sizeof(struct stat));
+    st = &res.target->backing->st;
   }
 
+  if (!copy_to_user(statbuf, st, sizeof(struct stat)))
+    set_errno(EFAULT);
+
   return;
 }
 
 static void sys_fork(cpu_ctx_t *context) {
   struct exec_args __dummy_arg = {0};
   vm_space_t *new_space = vm_space_create();
-  vm_space_fork(this_cpu->cur_thread->parent->space, new_space);
+  vm_space_fork(cur_proc->space, new_space);
 
   proc_t *child_process =
-      create_process(this_cpu->cur_thread->parent, new_space, NULL);
+      create_process(cur_proc, new_space, NULL);
   thread_t *child_thread =
       uthread_create(child_process, NULL, __dummy_arg, false);
 
@@ -369,10 +504,200 @@ static void sys_fork(cpu_ctx_t *context) {
   memcpy(&child_thread->context, context, sizeof(cpu_ctx_t));
 #endif
 
+  sched_inherit(child_thread, this_cpu_read(cur_thread));
   sched_queue(child_thread);
   sc_write(ARG0(context), child_process->pid, pid_t);
 }
 
+// Creates a child process running a new executable, without duplicating
+// the caller's space (which fork+exec would only throw away)
+static void sys_spawn(cpu_ctx_t *context) {
+  if (!ARG0(context) || !ARG1(context) || !ARG2(context)) {
+    set_errno(EFAULT);
+    return;
+  }
+
+  char *path = user_strdup(ARG0(context));
+  char **argv = path ? user_strvec_dup(ARG1(context)) : NULL;
+  char **envp = argv ? user_strvec_dup(ARG2(context)) : NULL;
+  if (envp == NULL) {
+    if (argv) free_strvec(argv);
+    kfree(path);
+    return;
+  }
+
+  struct exec_args args = {.argp = (const char **)argv,
+                           .envp = (const char **)envp};
+
+  // Both of these set errno themselves on failure
+  proc_t *child_process =
+      create_process(cur_proc, NULL, NULL);
+  thread_t *child_thread = NULL;
+  if (child_process) {
+    child_thread = uthread_create(child_process, path, args, true);
+    if (child_thread == NULL) destroy_process(child_process);
+  }
+
+  free_strvec(argv);
+  free_strvec(envp);
+  kfree(path);
+
+  if (child_thread == NULL) return;
+
+  sched_inherit(child_thread, this_cpu_read(cur_thread));
+  sched_queue(child_thread);
+  sc_write(ARG3(context), child_process->pid, pid_t);
+}
+
+// Looks up the process whose scheduling parameters are being changed, where
+// a PID of 0 means the caller. The process comes back locked, so that the
+// reaper can't free its threads while they're being looked at.
+static proc_t *sched_target(uint32_t pid, bool *irq) {
+  proc_t *proc = (pid == 0) ? cur_proc : proc_find(pid);
+  if (proc != NULL) {
+    *irq = spinlock_irq(&proc->lock);
+    if (proc->threads.length != 0) return proc;
+
+    spinrelease_irq(&proc->lock, *irq);
+  }
+
+  set_errno(ESRCH);
+  return NULL;
+}
+
+// Process groups and users don't exist (yet)
+static proc_t *prio_target(cpu_ctx_t *context, bool *irq) {
+  if (ARG0(context) != PRIO_PROCESS) {
+    set_errno(EINVAL);
+    return NULL;
+  }
+
+  return sched_target(ARG1(context), irq);
+}
+
+static void sys_setpriority(cpu_ctx_t *context) {
+  bool irq;
+  proc_t *proc = prio_target(context, &irq);
+  if (proc == NULL) return;
+
+  for (int i = 0; i < proc->threads.length; i++)
+    sched_set_nice(proc->threads.data[i], (int)ARG2(context));
+
+  spinrelease_irq(&proc->lock, irq);
+}
+
+static void sys_getpriority(cpu_ctx_t *context) {
+  bool irq;
+  proc_t *proc = prio_target(context, &irq);
+  if (proc == NULL) return;
+
+  int nice = proc->threads.data[0]->nice;
+  spinrelease_irq(&proc->lock, irq);
+  sc_write(ARG2(context), nice, int);
+}
+
+static void sys_sched_setscheduler(cpu_ctx_t *context) {
+  // Check the parameters up front, so that it's all or nothing
+  int policy = ARG1(context), priority = ARG2(context);
+  if (!sched_policy_valid(policy, priority)) {
+    set_errno(EINVAL);
+    return;
+  }
+
+  bool irq;
+  proc_t *proc = sched_target(ARG0(context), &irq);
+  if (proc == NULL) return;
+
+  for (int i = 0; i < proc->threads.length; i++)
+    sched_set_policy(proc->threads.data[i], policy, priority);
+
+  spinrelease_irq(&proc->lock, irq);
+}
+
+static void sys_sched_getscheduler(cpu_ctx_t *context) {
+  bool irq;
+  proc_t *proc = sched_target(ARG0(context), &irq);
+  if (proc == NULL) return;
+
+  thread_t *thread = proc->threads.data[0];
+  int policy = thread->policy, priority = thread->rt_priority;
+  spinrelease_irq(&proc->lock, irq);
+
+  sc_write(ARG1(context), policy, int);
+  sc_write(ARG2(context), priority, int);
+}
+
+static void sys_sched_setaffinity(cpu_ctx_t *context) {
+  // Masks can be of any size, where CPUs past the ones we support are ignored
+  cpumask_t mask = {0};
+  size_t size = MIN((size_t)ARG1(context), sizeof(cpumask_t));
+  if (!copy_from_user(&mask, (void *)ARG2(context), size)) {
+    set_errno(EFAULT);
+    return;
+  } else if (!sched_affinity_valid(&mask)) {
+    set_errno(EINVAL);
+    return;
+  }
+
+  bool irq;
+  proc_t *proc = sched_target(ARG0(context), &irq);
+  if (proc == NULL) return;
+
+  // Moving ourselves off of this CPU means yielding, which can't be done with
+  // the lock held, so that's left for last
+  thread_t *self = this_cpu_read(cur_thread);
+  bool has_self = false;
+  for (int i = 0; i < proc->threads.length; i++) {
+    if (proc->threads.data[i] == self)
+      has_self = true;
+    else
+      sched_set_affinity(proc->threads.data[i], &mask);
+  }
+
+  spinrelease_irq(&proc->lock, irq);
+  if (has_self) sched_set_affinity(self, &mask);
+}
+
+static void sys_sched_getaffinity(cpu_ctx_t *context) {
+  if (ARG1(context) < sizeof(cpumask_t)) {
+    set_errno(EINVAL);
+    return;
+  }
+
+  bool irq;
+  proc_t *proc = sched_target(ARG0(context), &irq);
+  if (proc == NULL) return;
+
+  cpumask_t mask;
+  sched_get_affinity(proc->threads.data[0], &mask);
+  spinrelease_irq(&proc->lock, irq);
+
+  if (!copy_to_user((void *)ARG2(context), &mask, sizeof(cpumask_t)))
+    set_errno(EFAULT);
+}
+
+static void sys_nanosleep(cpu_ctx_t *context) {
+  struct timespec req;
+  if (!copy_from_user(&req, (void *)ARG0(context), sizeof(struct timespec))) {
+    set_errno(EFAULT);
+    return;
+  }
+
+  if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000L) {
+    set_errno(EINVAL);
+    return;
+  }
+
+  // Anything past a few centuries might as well be forever
+  uint64_t secs = MIN((uint64_t)req.tv_sec, UINT64_MAX / 2000000000UL);
+  thread_sleep_until(timer_get_ns() + secs * 1000000000UL + req.tv_nsec);
+
+  // Nothing can interrupt the sleep, so there's never any time left over
+  struct timespec rem = {0};
+  if (ARG1(context) && !copy_to_user((void *)ARG1(context), &rem, sizeof(rem)))
+    set_errno(EFAULT);
+}
+
 uintptr_t syscall_table[] = {[SYS_DEBUG_LOG] = (uintptr_t)sys_debug_log,
                              [SYS_OPEN] = (uintptr_t)sys_open,
                              [SYS_VM_MAP] = (uintptr_t)sys_vm_map,
@@ -389,5 +714,19 @@ uintptr_t syscall_table[] = {[SYS_DEBUG_LOG] = (uintptr_t)sys_debug_log,
                              [SYS_IOCTL] = (uintptr_t)sys_ioctl,
                              [SYS_GETCWD] = (uintptr_t)sys_getcwd,
                              [SYS_STAT] = (uintptr_t)sys_stat,
-                             [SYS_FORK] = (uintptr_t)sys_fork};
+                             [SYS_FORK] = (uintptr_t)sys_fork,
+                             [SYS_SPAWN] = (uintptr_t)sys_spawn,
+                             [SYS_VM_PROTECT] = (uintptr_t)sys_vm_protect,
+                             [SYS_VM_ADVISE] = (uintptr_t)sys_vm_advise,
+                             [SYS_SETPRIORITY] = (uintptr_t)sys_setpriority,
+                             [SYS_GETPRIORITY] = (uintptr_t)sys_getpriority,
+                             [SYS_SCHED_SETSCHEDULER] =
+                                 (uintptr_t)sys_sched_setscheduler,
+                             [SYS_SCHED_GETSCHEDULER] =
+                                 (uintptr_t)sys_sched_getscheduler,
+                             [SYS_SCHED_SETAFFINITY] =
+                                 (uintptr_t)sys_sched_setaffinity,
+                             [SYS_SCHED_GETAFFINITY] =
+                                 (uintptr_t)sys_sched_getaffinity,
+                             [SYS_NANOSLEEP] = (uintptr_t)sys_nanosleep};
 uintptr_t nr_syscalls = ARRAY_LEN(syscall_table);
@@ -75,7 +75,7 @@ void htab_insert(struct hash_table *htab,
 
   // Destroy the cloned keys, before destroying the entire table
   for (size_t i = 0; i < htab->capacity; i++)
-    if (htab->keys[i] != NULL) kfree(htab->keys[index]);
+    if (htab->keys[i] != NULL) kfree(htab->keys[i]);
   kfree(htab->keys);
   kfree(htab->data);
 
@@ -102,3 +102,22 @@ void htab_delete(struct hash_table *htab, void *key, size_t key_size) {
     }
   }
 }
+
+void htab_clone(struct hash_table *dest,
+                struct hash_table *src,
+                size_t key_size) {
+  dest->capacity = src->capacity;
+  if (src->capacity == 0) return;
+
+  // Keep the same layout as the source, so that no rehashing is needed
+  dest->data = kmalloc(src->capacity * sizeof(void *));
+  dest->keys = kmalloc(src->capacity * sizeof(void *));
+  memcpy(dest->data, src->data, src->capacity * sizeof(void *));
+
+  for (size_t i = 0; i < (size_t)src->capacity; i++) {
+    if (src->keys[i] == NULL) continue;
+
+    dest->keys[i] = kmalloc(key_size);
+    memcpy(dest->keys[i], src->keys[i], key_size);
+  }
+}
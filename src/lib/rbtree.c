@@ -0,0 +1,258 @@
+#include <lib/rbtree.h>
+
+// Missing children (NULL) count as black nodes
+#define is_red(n) ((n) != NULL && (n)->red)
+
+static void replace_child(struct rb_tree *tree,
+                          struct rb_node *parent,
+                          struct rb_node *old,
+                          struct rb_node *new) {
+  if (parent == NULL)
+    tree->root = new;
+  else if (parent->left == old)
+    parent->left = new;
+  else
+    parent->right = new;
+}
+
+static void rotate_left(struct rb_tree *tree, struct rb_node *x) {
+  struct rb_node *y = x->right;
+
+  x->right = y->left;
+  if (y->left) y->left->parent = x;
+
+  y->parent = x->parent;
+  replace_child(tree, x->parent, x, y);
+  y->left = x;
+  x->parent = y;
+}
+
+static void rotate_right(struct rb_tree *tree, struct rb_node *x) {
+  struct rb_node *y = x->left;
+
+  x->left = y->right;
+  if (y->right) y->right->parent = x;
+
+  y->parent = x->parent;
+  replace_child(tree, x->parent, x, y);
+  y->right = x;
+  x->parent = y;
+}
+
+void rb_insert(struct rb_tree *tree, struct rb_node *node, rb_less_t less) {
+  struct rb_node **link = &tree->root, *parent = NULL;
+  bool leftmost = true;
+
+  // Equal keys go to the right, so that they're handed out in FIFO order
+  while (*link) {
+    parent = *link;
+    if (less(node, parent)) {
+      link = &parent->left;
+    } else {
+      link = &parent->right;
+      leftmost = false;
+    }
+  }
+
+  node->parent = parent;
+  node->left = node->right = NULL;
+  node->red = true;
+  *link = node;
+  if (leftmost) tree->leftmost = node;
+
+  // Fix any red node with a red parent, going up the tree (the root is always
+  // black, so a red parent always has a parent of its own)
+  while (is_red(node->parent)) {
+    parent = node->parent;
+    struct rb_node *gparent = parent->parent;
+
+    if (parent == gparent->left) {
+      struct rb_node *uncle = gparent->right;
+      if (is_red(uncle)) {
+        parent->red = uncle->red = false;
+        gparent->red = true;
+        node = gparent;
+        continue;
+      }
+
+      if (node == parent->right) {
+        rotate_left(tree, parent);
+        parent = node;
+      }
+
+      parent->red = false;
+      gparent->red = true;
+      rotate_right(tree, gparent);
+      break;
+    } else {
+      struct rb_node *uncle = gparent->left;
+      if (is_red(uncle)) {
+        parent->red = uncle->red = false;
+        gparent->red = true;
+        node = gparent;
+        continue;
+      }
+
+      if (node == parent->left) {
+        rotate_right(tree, parent);
+        parent = node;
+      }
+
+      parent->red = false;
+      gparent->red = true;
+      rotate_left(tree, gparent);
+      break;
+    }
+  }
+
+  tree->root->red = false;
+}
+
+// Restores the black height after a black node was removed, where 'x' (which
+// may be NULL) is the node that took its place under 'parent'
+static void remove_fixup(struct rb_tree *tree,
+                         struct rb_node *x,
+                         struct rb_node *parent) {
+  while (x != tree->root && !is_red(x)) {
+    if (x == parent->left) {
+      struct rb_node *w = parent->right;
+      if (w->red) {
+        w->red = false;
+        parent->red = true;
+        rotate_left(tree, parent);
+        w = parent->right;
+      }
+
+      if (!is_red(w->left) && !is_red(w->right)) {
+        w->red = true;
+        x = parent;
+        parent = x->parent;
+        continue;
+      }
+
+      if (!is_red(w->right)) {
+        w->left->red = false;
+        w->red = true;
+        rotate_right(tree, w);
+        w = parent->right;
+      }
+
+      w->red = parent->red;
+      parent->red = false;
+      w->right->red = false;
+      rotate_left(tree, parent);
+      x = tree->root;
+    } else {
+      struct rb_node *w = parent->left;
+      if (w->red) {
+        w->red = false;
+        parent->red = true;
+        rotate_right(tree, parent);
+        w = parent->left;
+      }
+
+      if (!is_red(w->left) && !is_red(w->right)) {
+        w->red = true;
+        x = parent;
+        parent = x->parent;
+        continue;
+      }
+
+      if (!is_red(w->left)) {
+        w->right->red = false;
+        w->red = true;
+        rotate_left(tree, w);
+        w = parent->left;
+      }
+
+      w->red = parent->red;
+      parent->red = false;
+      w->left->red = false;
+      rotate_right(tree, parent);
+      x = tree->root;
+    }
+  }
+
+  if (x) x->red = false;
+}
+
+void rb_remove(struct rb_tree *tree, struct rb_node *node) {
+  struct rb_node *child, *parent;
+  bool red;
+
+  if (tree->leftmost == node) tree->leftmost = rb_next(node);
+
+  if (node->left && node->right) {
+    // Swap in the successor, which has no left child by definition
+    struct rb_node *succ = node->right;
+    while (succ->left)
+      succ = succ->left;
+
+    child = succ->right;
+    parent = succ->parent;
+    red = succ->red;
+
+    if (parent == node) {
+      parent = succ;
+    } else {
+      parent->left = child;
+      if (child) child->parent = parent;
+
+      succ->right = node->right;
+      node->right->parent = succ;
+    }
+
+    succ->left = node->left;
+    node->left->parent = succ;
+    succ->parent = node->parent;
+    succ->red = node->red;
+    replace_child(tree, node->parent, node, succ);
+  } else {
+    child = node->left ? node->left : node->right;
+    parent = node->parent;
+    red = node->red;
+
+    if (child) child->parent = parent;
+    replace_child(tree, parent, node, child);
+  }
+
+  if (!red) remove_fixup(tree, child, parent);
+}
+
+struct rb_node *rb_last(struct rb_tree *tree) {
+  struct rb_node *node = tree->root;
+  while (node && node->right)
+    node = node->right;
+
+  return node;
+}
+
+struct rb_node *rb_next(struct rb_node *node) {
+  if (node->right) {
+    node = node->right;
+    while (node->left)
+      node = node->left;
+
+    return node;
+  }
+
+  while (node->parent && node == node->parent->right)
+    node = node->parent;
+
+  return node->parent;
+}
+
+struct rb_node *rb_prev(struct rb_node *node) {
+  if (node->left) {
+    node = node->left;
+    while (node->right)
+      node = node->right;
+
+    return node;
+  }
+
+  while (node->parent && node == node->parent->left)
+    node = node->parent;
+
+  return node->parent;
+}
@@ -0,0 +1,212 @@
+#include <lib/builtin.h>
+#include <lib/kcon.h>
+#include <vm/cache.h>
+#include <vm/phys.h>
+#include <vm/vm.h>
+
+static struct vm_cache *get_cache(struct vnode *node) {
+  if (node->cache != NULL) return node->cache;
+
+  // Create the cache, unless someone else beat us to it
+  struct vm_cache *expected = NULL;
+  struct vm_cache *cache = kmalloc(sizeof(struct vm_cache));
+  if (!ATOMIC_CAS(&node->cache, &expected, cache)) kfree(cache);
+
+  return node->cache;
+}
+
+static struct vm_page *cache_find(struct vm_cache *cache, size_t offset) {
+  bool irq = spinlock_irq(&cache->lock);
+  struct vm_page *pg = htab_find(&cache->pages, &offset, sizeof(size_t));
+  spinrelease_irq(&cache->lock, irq);
+  return pg;
+}
+
+// Where 'off' bytes into a cached page can be found in the direct map
+#define page_ptr(pg, off) \
+  ((void *)((uintptr_t)(pg)->metadata + VM_MEM_OFFSET + (off)))
+
+void vm_cache_set_backing(struct vnode *node) {
+  get_cache(node)->backing = true;
+}
+
+struct vm_page *vm_cache_get(struct vnode *node, size_t offset) {
+  struct vm_cache *cache = get_cache(node);
+  size_t page_size = cur_config->page_size;
+  offset = ALIGN_DOWN(offset, page_size);
+
+  struct vm_page *pg = cache_find(cache, offset);
+  if (pg != NULL) return pg;
+
+  // Read the page in from the file, leaving anything past EOF zeroed. Pages
+  // of files that live in the cache start out zeroed, like any other hole.
+  uintptr_t phys =
+      (uintptr_t)vm_phys_alloc(page_size / VM_PAGE_SIZE, VM_ALLOC_ZERO);
+  if (phys == 0) return NULL;
+
+  if (!cache->backing && offset < (size_t)node->st.st_size) {
+    size_t count = MIN(page_size, (size_t)node->st.st_size - offset);
+    node->read(node, (void *)(phys + VM_MEM_OFFSET), offset, count);
+  }
+
+  // The cache itself holds the only reference, since pages only go away
+  // along with the entire cache
+  struct vm_page *new_pg = kmalloc(sizeof(struct vm_page));
+  new_pg->metadata = (void *)phys;
+  new_pg->refcount = 1;
+  new_pg->present = 1;
+
+  // Someone else might've read the same page in the meantime, in which case
+  // theirs wins
+  bool irq = spinlock_irq(&cache->lock);
+  pg = htab_find(&cache->pages, &offset, sizeof(size_t));
+  if (pg == NULL) {
+    htab_insert(&cache->pages, &offset, sizeof(size_t), new_pg);
+    pg = new_pg;
+  }
+  spinrelease_irq(&cache->lock, irq);
+
+  if (pg != new_pg) {
+    vm_phys_free((void *)phys, page_size / VM_PAGE_SIZE);
+    kfree(new_pg);
+  }
+
+  return pg;
+}
+
+void vm_cache_read(struct vnode *node, void *buf, size_t offset, size_t count) {
+  struct vm_cache *cache = get_cache(node);
+  size_t page_size = cur_config->page_size;
+
+  for (size_t cur = offset; cur < offset + count;) {
+    size_t page_off = ALIGN_DOWN(cur, page_size);
+    size_t len = MIN(page_off + page_size, offset + count) - cur;
+    void *dest = (void *)((uintptr_t)buf + (cur - offset));
+
+    struct vm_page *pg = cache_find(cache, page_off);
+    if (pg != NULL)
+      memcpy(dest, page_ptr(pg, cur - page_off), len);
+    else
+      memset(dest, 0, len);
+
+    cur += len;
+  }
+}
+
+size_t vm_cache_write(struct vnode *node,
+                      const void *buf,
+                      size_t offset,
+                      size_t count) {
+  size_t page_size = cur_config->page_size;
+  size_t cur = offset;
+
+  while (cur < offset + count) {
+    size_t page_off = ALIGN_DOWN(cur, page_size);
+    size_t len = MIN(page_off + page_size, offset + count) - cur;
+
+    struct vm_page *pg = vm_cache_get(node, page_off);
+    if (pg == NULL) break;  // OOM has occured!
+
+    memcpy(page_ptr(pg, cur - page_off),
+           (void *)((uintptr_t)buf + (cur - offset)), len);
+    cur += len;
+  }
+
+  return cur - offset;
+}
+
+void vm_cache_clear(struct vnode *node, size_t offset, size_t count) {
+  struct vm_cache *cache = node->cache;
+  size_t page_size = cur_config->page_size;
+  if (cache == NULL) return;
+
+  for (size_t cur = offset; cur < offset + count;) {
+    size_t page_off = ALIGN_DOWN(cur, page_size);
+    size_t len = MIN(page_off + page_size, offset + count) - cur;
+
+    struct vm_page *pg = cache_find(cache, page_off);
+    if (pg != NULL) memset(page_ptr(pg, cur - page_off), 0, len);
+
+    cur += len;
+  }
+}
+
+void vm_cache_update(struct vnode *node,
+                     const void *buf,
+                     off_t offset,
+                     size_t count) {
+  struct vm_cache *cache = node->cache;
+  size_t page_size = cur_config->page_size;
+  if (cache == NULL || cache->backing) return;
+
+  bool irq = spinlock_irq(&cache->lock);
+  for (size_t cur = offset; cur < offset + count;) {
+    size_t page_off = ALIGN_DOWN(cur, page_size);
+    size_t len = MIN(page_off + page_size, offset + count) - cur;
+
+    struct vm_page *pg = htab_find(&cache->pages, &page_off, sizeof(size_t));
+    if (pg != NULL) {
+      memcpy(page_ptr(pg, cur - page_off),
+             (void *)((uintptr_t)buf + (cur - offset)), len);
+    }
+
+    cur += len;
+  }
+  spinrelease_irq(&cache->lock, irq);
+}
+
+void vm_cache_writeback(struct vnode *node, size_t offset, size_t len) {
+  struct vm_cache *cache = node->cache;
+  size_t page_size = cur_config->page_size;
+  if (cache == NULL || cache->backing) return;
+
+  for (size_t cur = ALIGN_DOWN(offset, page_size); cur < offset + len;
+       cur += page_size) {
+    // Pages stay around for as long as the caller's mapping does, so they
+    // can be written out without the lock
+    bool irq = spinlock_irq(&cache->lock);
+    struct vm_page *pg = htab_find(&cache->pages, &cur, sizeof(size_t));
+    bool dirty = (pg != NULL && pg->dirty);
+    if (dirty) pg->dirty = 0;
+    spinrelease_irq(&cache->lock, irq);
+
+    // Never grow the file, since mappings can't extend it
+    if (dirty && cur < (size_t)node->st.st_size) {
+      size_t count = MIN(page_size, (size_t)node->st.st_size - cur);
+      node->write(node, page_ptr(pg, 0), cur, count);
+    }
+  }
+}
+
+void vm_cache_hold(struct vnode *node) {
+  struct vm_cache *cache = get_cache(node);
+  bool irq = spinlock_irq(&cache->lock);
+  cache->users++;
+  spinrelease_irq(&cache->lock, irq);
+}
+
+void vm_cache_release(struct vnode *node) {
+  struct vm_cache *cache = node->cache;
+  struct hash_table pages = {0};
+
+  // Once the last mapping is gone, a copy of the file isn't worth keeping
+  // around (everything dirty was written back when it was unmapped)
+  bool irq = spinlock_irq(&cache->lock);
+  if (--cache->users == 0 && !cache->backing) {
+    pages = cache->pages;
+    cache->pages = (struct hash_table){0};
+  }
+  spinrelease_irq(&cache->lock, irq);
+
+  for (size_t i = 0; i < (size_t)pages.capacity; i++) {
+    struct vm_page *pg = pages.data[i];
+    if (pg == NULL) continue;
+
+    vm_phys_free(pg->metadata, cur_config->page_size / VM_PAGE_SIZE);
+    kfree(pg);
+    kfree(pages.keys[i]);
+  }
+
+  kfree(pages.keys);
+  kfree(pages.data);
+}
@@ -1,8 +1,11 @@
 #include <arch/hat.h>
 #include <arch/smp.h>
 #include <lib/builtin.h>
+#include <lib/cmdline.h>
 #include <lib/errno.h>
 #include <lib/kcon.h>
+#include <lib/lock.h>
+#include <vm/cache.h>
 #include <vm/phys.h>
 #include <vm/virt.h>
 #include <vm/vm.h>
@@ -15,14 +18,14 @@ static bool verify_prot(enum vm_fault real_prot, int prot) {
 
   if ((real_prot & VM_FAULT_EXEC) && !(prot & PROT_EXEC)) return false;
 
-  if (prot & PROT_NONE) return false;
+  if (prot == PROT_NONE) return false;
 
   return true;
 }
 static int calculate_prot(int unix_prot) {
   int result = VM_PERM_READ | VM_PERM_USER;
 
-  if (unix_prot & PROT_NONE) return 0;
+  if (unix_prot == PROT_NONE) return 0;
 
   if (unix_prot & PROT_WRITE) result |= VM_PERM_WRITE;
 
@@ -37,9 +40,285 @@ static uintptr_t alloc_mmap_base(vm_space_t *spc, size_t len) {
   return spc->mmap_base;
 }
 
+// Keeps the usage counters of a segment (and its space) in sync, as pages
+// are mapped/unmapped and added to/dropped from the amap
+static void seg_account(struct vm_seg *segment,
+                        ssize_t resident,
+                        ssize_t anon) {
+  vm_space_t *space = segment->space;
+  segment->resident += resident;
+  segment->anon += anon;
+  ATOMIC_ADD(&space->resident, resident);
+  ATOMIC_ADD(&space->anon, anon);
+}
+
+// File segments hold a reference to their vnode, so that it (and its page
+// cache) outlives whatever handle the mapping was created through
+static void seg_hold_file(struct vm_seg *segment) {
+  struct vnode *node = segment->context;
+  if (node == NULL) return;
+
+  spinlock(&node->lock);
+  node->refcount++;
+  spinrelease(&node->lock);
+  vm_cache_hold(node);
+}
+
+static void seg_put_file(struct vm_seg *segment) {
+  struct vnode *node = segment->context;
+  if (node == NULL) return;
+
+  vm_cache_release(node);
+  node->close(node);
+}
+
+// Drops the PTEs within [base, base + len), but not the pages behind them.
+// Pages that another space read into a table it still shared with us were
+// never counted here (see seg_populate), so don't count them out either.
+static void seg_unmap_ptes(struct vm_seg *segment, uintptr_t base, size_t len) {
+  size_t unmapped = vm_unmap_range(segment->space, base, len);
+  seg_account(segment, -(ssize_t)MIN(unmapped, segment->resident), 0);
+}
+
+// Pages of private mappings that are only partially backed by the file (like
+// the one holding the start of an ELF's bss) always get a private copy, so
+// that whatever follows in the file doesn't leak in
+static bool partial_page(struct vm_seg *segment, size_t off) {
+  return (segment->context != NULL && !(segment->mode & MAP_SHARED) &&
+          off < segment->file_len &&
+          off + cur_config->page_size > segment->file_len);
+}
+
 //////////////////////////////////
 //      Anonymous Segments
 //////////////////////////////////
+// Amount of pages mapped in around a faulting address (must be a power of 2)
+static size_t fault_around = 16;
+
+// A single page of zeroes, which is mapped read-only for reads of untouched
+// anonymous memory (and replaced with a private page on the first write)
+static uintptr_t zero_page = 0;
+
+static struct vm_amap *amap_create() {
+  struct vm_amap *amap = kmalloc(sizeof(struct vm_amap));
+  amap->refcount = 1;
+  return amap;
+}
+
+// Drops a reference to the amap, freeing it (and any pages only it used)
+static void amap_release(struct vm_amap *amap) {
+  if (ATOMIC_DEC(&amap->refcount) != 0) return;
+
+  for (size_t i = 0; i < (size_t)amap->pagelist.capacity; i++) {
+    struct vm_page *pg = amap->pagelist.data[i];
+    if (pg == NULL) continue;
+
+    if (ATOMIC_DEC(&pg->refcount) == 0) {
+      vm_phys_free(pg->metadata, cur_config->page_size / VM_PAGE_SIZE);
+      kfree(pg);
+    }
+
+    kfree(amap->pagelist.keys[i]);
+  }
+
+  kfree(amap->pagelist.keys);
+  kfree(amap->pagelist.data);
+  kfree(amap);
+}
+
+// Returns the segment's pagelist, taking a private copy of it first if it
+// is about to be modified while shared
+static struct hash_table *anon_pagelist(struct vm_seg *segment, bool writing) {
+  if (!writing || !segment->needs_copy)
+    return &segment->amap->pagelist;
+
+  struct vm_amap *amap = segment->amap;
+  if (ATOMIC_READ(&amap->refcount) > 1) {
+    struct vm_amap *new_amap = amap_create();
+    htab_clone(&new_amap->pagelist, &amap->pagelist, sizeof(size_t));
+
+    for (size_t i = 0; i < (size_t)amap->pagelist.capacity; i++) {
+      struct vm_page *pg = amap->pagelist.data[i];
+      if (pg != NULL) ATOMIC_INC(&pg->refcount);
+    }
+
+    segment->amap = new_amap;
+    amap_release(amap);
+  }
+
+  segment->needs_copy = false;
+  return &segment->amap->pagelist;
+}
+
+// Finds the page that untouched parts of a segment read from, which is the
+// cached file page for file mappings, and the zero page otherwise (or 0, if
+// the file's page couldn't be read in). Shared mappings stick to the cache
+// even past EOF, so that stores to those pages land in the same place that
+// loads come from.
+static uintptr_t backing_page(struct vm_seg *segment, size_t offset) {
+  if (segment->context == NULL ||
+      (!(segment->mode & MAP_SHARED) && offset >= segment->file_len))
+    return zero_page;
+
+  struct vm_page *pg = vm_cache_get(segment->context, segment->offset + offset);
+  return pg ? (uintptr_t)pg->metadata : 0;
+}
+
+// Maps every untouched page within [start, end) (which are offsets into the
+// segment), descending the page tables once per leaf table. Reads only map
+// the backing page read-only, while writes allocate private copies, grabbing
+// all the pages of a table in one go where possible. Returns false if it ran
+// out of memory before getting through all of them.
+//
+// Tables still shared with another space since a fork are only copied for
+// writes, since reads map the same page into every space sharing them. The
+// private copy of a partial page is the exception.
+static bool seg_populate(vm_space_t *space,
+                         struct vm_seg *segment,
+                         size_t start,
+                         size_t end,
+                         bool writing) {
+  size_t page_size = cur_config->page_size;
+  int flags = calculate_prot(segment->prot);
+  int alloc_flags = (segment->context == NULL) ? VM_ALLOC_ZERO : 0;
+  struct hash_table *pagelist = anon_pagelist(segment, writing);
+  size_t mapped = 0, allocated = 0;
+  bool success = false;
+
+  while (start < end) {
+    // Clamp the run to the end of the current leaf table
+    uintptr_t virt = segment->base + start;
+    size_t run = ALIGN_UP(virt + 1, cur_config->huge_page_size) - virt;
+    size_t npages = MIN(run, end - start) / page_size;
+    size_t tail = ALIGN_DOWN(segment->file_len, page_size);
+    bool unshare = (writing || !segment->forked ||
+                    (partial_page(segment, tail) && tail >= start &&
+                     tail < start + (npages * page_size)));
+
+    uint64_t *pte = hat_translate_addr(
+        space, virt, TRANSLATE_CREATE | (unshare ? TRANSLATE_UNSHARE : 0),
+        TRANSLATE_DEPTH_NORM);
+    if (pte == NULL) goto done;  // OOM has occured!
+
+    // Find out how many pages actually need backing
+    size_t missing = 0;
+    for (size_t i = 0; i < npages; i++) {
+      size_t off = start + (i * page_size);
+      if (!hat_pte_present(pte[i]) &&
+          !htab_find(pagelist, &off, sizeof(size_t)))
+        missing++;
+    }
+
+    // Grab the pages in one go, falling back to single pages if the
+    // zone couldn't satisfy a contiguous run
+    uintptr_t batch = 0;
+    if (writing && missing > 1)
+      batch = (uintptr_t)vm_phys_alloc(missing * (page_size / VM_PAGE_SIZE),
+                                       alloc_flags);
+
+    size_t used = 0;
+    for (size_t i = 0; i < npages; i++) {
+      size_t off = start + (i * page_size);
+      if (hat_pte_present(pte[i]) ||
+          htab_find(pagelist, &off, sizeof(size_t)))
+        continue;
+
+      bool partial = partial_page(segment, off);
+      uintptr_t backing = backing_page(segment, off);
+      if (backing == 0) goto failed;
+
+      if (!writing && !partial) {
+        pte[i] = hat_create_pte(flags & ~VM_PERM_WRITE, backing, false);
+        mapped++;
+        continue;
+      }
+
+      uintptr_t phys = 0;
+      if (batch)
+        phys = batch + (used++ * page_size);
+      else
+        phys = (uintptr_t)vm_phys_alloc(page_size / VM_PAGE_SIZE, alloc_flags);
+      if (phys == 0) goto failed;
+
+      if (segment->context != NULL) {
+        size_t count =
+            (off < segment->file_len) ? MIN(page_size, segment->file_len - off)
+                                      : 0;
+        memcpy((void *)(phys + VM_MEM_OFFSET),
+               (void *)(backing + VM_MEM_OFFSET), count);
+        memset((void *)(phys + VM_MEM_OFFSET + count), 0, page_size - count);
+      }
+
+      struct vm_page *pg = kmalloc(sizeof(struct vm_page));
+      pg->metadata = (void *)phys;
+      pg->present = 1;
+      pg->refcount = 1;
+      htab_insert(pagelist, &off, sizeof(size_t), pg);
+
+      pte[i] = hat_create_pte(flags, phys, false);
+      mapped++;
+      allocated++;
+    }
+
+    start += npages * page_size;
+    continue;
+
+  failed:
+    // Give back whatever is left of the batch
+    if (batch && used < missing)
+      vm_phys_free((void *)(batch + (used * page_size)),
+                   (missing - used) * (page_size / VM_PAGE_SIZE));
+    goto done;
+  }
+
+  success = true;
+done:
+  seg_account(segment, mapped, allocated);
+  return success;
+}
+
+// Points the PTE at 'offset' to 'phys', flushing the old translation. Like
+// seg_populate, only writes copy a table still shared since a fork.
+static bool seg_remap(struct vm_seg *segment,
+                      size_t offset,
+                      uintptr_t phys,
+                      int flags,
+                      bool writing) {
+  vm_space_t *space = segment->space;
+  bool unshare = (writing || !segment->forked);
+  uint64_t *pte = hat_translate_addr(
+      space, segment->base + offset,
+      TRANSLATE_CREATE | (unshare ? TRANSLATE_UNSHARE : 0),
+      TRANSLATE_DEPTH_NORM);
+  if (pte == NULL) return false;  // OOM has occured!
+  if (!hat_pte_present(*pte)) seg_account(segment, 1, 0);
+
+  *pte = hat_create_pte(flags, phys, false);
+  vm_invl(space, segment->base + offset, cur_config->page_size);
+  return true;
+}
+
+// Populates the faulting page along with its neighbours, so that a linear
+// walk over the segment doesn't trap on every single page
+static bool populate_around(struct vm_seg *segment,
+                            size_t offset,
+                            bool writing) {
+  uintptr_t window = segment->hugepage ? cur_config->huge_page_size
+                                       : fault_around * cur_config->page_size;
+  uintptr_t start =
+      MAX(ALIGN_DOWN(segment->base + offset, window), segment->base);
+  uintptr_t end = MIN(start + window, segment->base + segment->len);
+  if (seg_populate(segment->space, segment, start - segment->base,
+                   end - segment->base, writing))
+    return true;
+
+  // Running out of memory further along the window is fine, as long as the
+  // faulting page itself made it in
+  uint64_t *pte = hat_translate_addr(segment->space, segment->base + offset,
+                                     0, TRANSLATE_DEPTH_NORM);
+  return pte != NULL && hat_pte_present(*pte);
+}
+
 static bool anon_fault(struct vm_seg *segment,
                        size_t offset,
                        enum vm_fault flags) {
@@ -49,91 +328,83 @@ static bool anon_fault(struct vm_seg *segment,
   if (offset % cur_config->page_size != 0)
     offset = ALIGN_DOWN(offset, cur_config->page_size);
 
-  struct vm_page *pg = htab_find(&segment->pagelist, &offset, sizeof(size_t));
-  if (pg == NULL) {
-    // Create the page metadata now, before we map it in...
-    pg = kmalloc(sizeof(struct vm_page));
-  } else if (pg->unmapped) {
-    return false;
-  } else {
-    klog("seg: fault on pre-mapped page???");
-    return false;
+  size_t page_size = cur_config->page_size;
+  int prot = calculate_prot(segment->prot);
+  struct hash_table *pagelist =
+      anon_pagelist(segment, (flags & VM_FAULT_WRITE));
+  struct vm_page *pg = htab_find(pagelist, &offset, sizeof(size_t));
+
+  // A page that is still shared with another space must stay read-only,
+  // until the first write breaks the sharing
+  if (pg != NULL && !(flags & VM_FAULT_PROTECTION)) {
+    if (segment->needs_copy || ATOMIC_READ(&pg->refcount) > 1)
+      prot &= ~VM_PERM_WRITE;
+
+    return seg_remap(segment, offset, (uintptr_t)pg->metadata, prot,
+                     (flags & VM_FAULT_WRITE));
   }
 
   // Perform a COW (Copy-on-Write), doing the actual allocation where needed
   if (flags & VM_FAULT_PROTECTION) {
-    // Find the parent page, so that we can determine the refcount
-    struct vm_seg *parent = segment->context;
-    if (!parent || !(flags & VM_FAULT_WRITE)) return false;
-
-    // Don't do the actual copy unless the page has been touched
-    struct vm_page *ppg = htab_find(&parent->pagelist, &offset, sizeof(size_t));
-    if (ppg && ppg->refcount >= 1 && ppg->present) {
-      uintptr_t phys_buffer =
-          (uintptr_t)vm_phys_alloc(cur_config->page_size / 0x1000, 0);
-      vm_map_range(this_cpu->cur_spc, phys_buffer, segment->base + offset,
-                   cur_config->page_size, calculate_prot(segment->prot));
-
-      // Copy in the parent page...
-      memcpy((void *)(phys_buffer + VM_MEM_OFFSET),
-             (void *)((uintptr_t)ppg->metadata + VM_MEM_OFFSET), 0x1000);
-
-      // Finally, make our own copy 'pg', and insert it into our pagelist
-      htab_insert(&segment->pagelist, &offset, sizeof(size_t), pg);
-      pg->metadata = (void *)phys_buffer;
-      pg->refcount = 1;
-      pg->present = 1;
+    if (!(flags & VM_FAULT_WRITE)) return false;
 
-      // Lower the parent's refcount, since we no longer rely on it
-      ppg->refcount -= 1;
-      goto finished;
+    // No descriptor means this is the zero page (or a cached file page), so
+    // replace it with a private copy
+    if (pg == NULL) {
+      seg_unmap_ptes(segment, segment->base + offset, page_size);
+      return seg_populate(segment->space, segment, offset, offset + page_size,
+                          true);
     }
-  }
 
-  // Otherwise, allocate a zero page, and map it in...
-  uintptr_t phys_window =
-      (uintptr_t)vm_phys_alloc(cur_config->page_size / 0x1000, VM_ALLOC_ZERO);
-  vm_map_range(this_cpu->cur_spc, phys_window, segment->base + offset,
-               cur_config->page_size, calculate_prot(segment->prot));
+    // We're the only user left, so just take the page back as writable
+    if (ATOMIC_READ(&pg->refcount) == 1)
+      return seg_remap(segment, offset, (uintptr_t)pg->metadata, prot, true);
+
+    // Otherwise, make our own copy of the page...
+    uintptr_t phys = (uintptr_t)vm_phys_alloc(page_size / VM_PAGE_SIZE, 0);
+    if (phys == 0) return false;
+    memcpy((void *)(phys + VM_MEM_OFFSET),
+           (void *)((uintptr_t)pg->metadata + VM_MEM_OFFSET), page_size);
+
+    struct vm_page *new_pg = kmalloc(sizeof(struct vm_page));
+    new_pg->metadata = (void *)phys;
+    new_pg->refcount = 1;
+    new_pg->present = 1;
+    htab_delete(pagelist, &offset, sizeof(size_t));
+    htab_insert(pagelist, &offset, sizeof(size_t), new_pg);
+    bool mapped = seg_remap(segment, offset, phys, prot, true);
+
+    // And drop our reference to the shared one, freeing it if the other
+    // side(s) copied it in the meantime
+    if (ATOMIC_DEC(&pg->refcount) == 0) {
+      vm_phys_free(pg->metadata, page_size / VM_PAGE_SIZE);
+      kfree(pg);
+    }
 
-  // Fill in the page metadata and push it in
-  htab_insert(&segment->pagelist, &offset, sizeof(size_t), pg);
-  pg->metadata = (void *)phys_window;
-  pg->present = 1;
-  pg->refcount = 1;
+    return mapped;
+  }
 
-finished:
-  return true;
+  return populate_around(segment, offset, (flags & VM_FAULT_WRITE));
 }
 
 static struct vm_seg *anon_clone(struct vm_seg *segment, void *space) {
-  // Copy the segment perfectly, except for the pagelist.
+  // Copy the segment perfectly, sharing the amap with the parent until
+  // either side writes to it
   struct vm_seg *new_segment = kmalloc(sizeof(struct vm_seg));
   *new_segment = *segment;
-  new_segment->context = segment;
-  memset(&new_segment->pagelist, 0, sizeof(struct hash_table));
-
-  // Make sure the parent segment has permissions
-  if (segment->prot & PROT_NONE) {
-    klog("seg: attempt to clone a segment with no protection!");
-    return segment;
-  }
-
-  // Next, map every present page in as read-only/read-write...
-  for (size_t i = 0; i < segment->len; i += cur_config->page_size) {
-    struct vm_page *pg = htab_find(&segment->pagelist, &i, sizeof(size_t));
-    if (pg == NULL) {
-      continue;
-    } else {
-      int flags = calculate_prot(segment->prot);
-      if (segment->mode & MAP_PRIVATE)
-        flags &= ~VM_PERM_WRITE;  // Copy-on-Write
-
-      pg->refcount++;
-      vm_map_range(space, (uintptr_t)pg->metadata, segment->base + i,
-                   cur_config->page_size, flags);
-    }
-  }
+  new_segment->space = space;
+  new_segment->resident = new_segment->anon = 0;
+  seg_account(new_segment, segment->resident, segment->anon);
+  seg_hold_file(new_segment);
+  ATOMIC_INC(&segment->amap->refcount);
+  segment->needs_copy = new_segment->needs_copy = true;
+  segment->forked = new_segment->forked = true;
+
+  // Then share the page tables themselves, which are only copied once
+  // either side writes into them. Segments without any protection have
+  // nothing mapped, but the child still inherits them (and their pages).
+  if (segment->prot != PROT_NONE)
+    hat_share_range(segment->space, space, segment->base, segment->len);
 
   return new_segment;
 }
@@ -146,32 +417,94 @@ static bool anon_unmap(struct vm_seg *segment,
   else if (unmap_base < segment->base || unmap_len > segment->len)
     return false;
 
-  // Iterate over all the pages, deleting/unref'ing them if needed!
-  for (size_t i = unmap_base; i < unmap_len; i += cur_config->page_size) {
-    struct vm_page *pg = htab_find(&segment->pagelist, &i, sizeof(size_t));
-    if (pg == NULL) {
+  // Drop the whole range from the page tables first, since pages backed by
+  // the zero page aren't tracked by the pagelist
+  seg_unmap_ptes(segment, unmap_base, unmap_len);
+
+  // Unmapping the entire segment only has to drop our reference to the amap
+  if (unmap_len == segment->len) {
+    seg_account(segment, 0, -(ssize_t)segment->anon);
+    amap_release(segment->amap);
+    segment->amap = amap_create();
+    segment->needs_copy = false;
+    return true;
+  }
+
+  // Otherwise, iterate over all the pages, deleting/unref'ing them if needed!
+  struct hash_table *pagelist = anon_pagelist(segment, true);
+  size_t start = unmap_base - segment->base;
+  for (size_t i = start; i < start + unmap_len; i += cur_config->page_size) {
+    struct vm_page *pg = htab_find(pagelist, &i, sizeof(size_t));
+    if (pg == NULL)
       continue;
-    } else {
-      pg->refcount--;
 
-      if (pg->refcount != 0) {
-        vm_unmap_range(this_cpu->cur_spc, segment->base + i,
-                       cur_config->page_size);
-        pg->unmapped = 1;
-        continue;
-      }
+    htab_delete(pagelist, &i, sizeof(size_t));
+    seg_account(segment, 0, -1);
+    if (ATOMIC_DEC(&pg->refcount) != 0)
+      continue;
 
-      vm_phys_free(pg->metadata, cur_config->page_size / VM_PAGE_SIZE);
-      vm_unmap_range(this_cpu->cur_spc, segment->base + i,
-                     cur_config->page_size);
-      htab_delete(&segment->pagelist, &i, sizeof(size_t));
-      kfree(pg);
-    }
+    vm_phys_free(pg->metadata, cur_config->page_size / VM_PAGE_SIZE);
+    kfree(pg);
   }
 
   return true;
 }
 
+static bool anon_advise(struct vm_seg *segment,
+                        uintptr_t base,
+                        size_t len,
+                        int advice) {
+  size_t start = base - segment->base;
+
+  switch (advice) {
+    case MADV_DONTNEED:
+      // Dropping the pages makes the range read back as zeroes (or as the
+      // file's contents) the next time it's touched
+      return anon_unmap(segment, base, len);
+    case MADV_WILLNEED:
+      // Anonymous memory will almost certainly be written, so allocate it
+      // up front instead of mapping in the zero page
+      seg_populate(segment->space, segment, start, start + len,
+                   segment->context == NULL && (segment->prot & PROT_WRITE));
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Creates the segment, and inserts it into the space (unless its embedded)
+static struct vm_seg *seg_create(vm_space_t *space,
+                                 uintptr_t hint,
+                                 uint64_t len,
+                                 int prot,
+                                 int mode) {
+  struct vm_seg *segment = kmalloc(sizeof(struct vm_seg));
+  segment->amap = amap_create();
+  segment->len = len;
+  segment->prot = prot;
+  segment->mode = mode;
+  segment->space = space;
+
+  if (mode & __MAP_EMBED_ONLY) return segment;
+
+  // Find a suitable base for this segment
+  if (!hint || !(mode & MAP_FIXED) || (hint % 0x1000 != 0)) {
+    segment->base = alloc_mmap_base(space, len);
+  } else {
+    if (vm_find_seg(hint, NULL) != NULL) {
+      klog("vm/seg: (WARN) hint 0x%lx tried to overwrite existing mapping!",
+           hint);
+      segment->base = alloc_mmap_base(space, len);
+    } else {
+      segment->base = hint;
+    }
+  }
+
+  // Add segment to the current space's mappings
+  vec_push(&space->mappings, segment);
+  return segment;
+}
+
 static struct vm_seg *anon_create(vm_space_t *space,
                                   uintptr_t hint,
                                   uint64_t len,
@@ -191,44 +524,181 @@ static struct vm_seg *anon_create(vm_space_t *space,
   }
 
   // Create the initial segment
-  struct vm_seg *segment = kmalloc(sizeof(struct vm_seg));
-  memset(&segment->pagelist, 0, sizeof(struct hash_table));
-  segment->len = len;
-  segment->prot = prot;
-  segment->mode = mode;
+  struct vm_seg *segment = seg_create(space, hint, len, prot, mode);
   segment->ops.fault = anon_fault;
   segment->ops.clone = anon_clone;
   segment->ops.unmap = anon_unmap;
+  segment->ops.advise = anon_advise;
 
-  if (mode & __MAP_EMBED_ONLY) return segment;
+  // Back the entire segment up front, if requested
+  if ((mode & MAP_NODEMAND) && !(mode & __MAP_EMBED_ONLY))
+    seg_populate(space, segment, 0, len, true);
 
-  // Find a suitable base for this segment
-  if (!hint || !(mode & MAP_FIXED) || (hint % 0x1000 != 0)) {
-    segment->base = alloc_mmap_base(space, len);
+  return segment;
+}
+
+//////////////////////////////////
+//        File Segments
+//////////////////////////////////
+// NOTE: Private file mappings are handled by the anonymous segment code, with
+// the file's cached pages standing in for the zero page. The functions here
+// are only used for shared mappings, which map the cached pages directly.
+static bool file_fault(struct vm_seg *segment,
+                       size_t offset,
+                       enum vm_fault flags) {
+  if (!verify_prot(flags, segment->prot)) return false;
+
+  // Align the offset to a page size
+  if (offset % cur_config->page_size != 0)
+    offset = ALIGN_DOWN(offset, cur_config->page_size);
+
+  // Reads map in the cached pages read-only, so that the first write to each
+  // page can be tracked
+  if (!(flags & VM_FAULT_WRITE)) {
+    if (flags & VM_FAULT_PROTECTION) return false;
+
+    return populate_around(segment, offset, false);
+  }
+
+  struct vm_page *pg = vm_cache_get(segment->context, segment->offset + offset);
+  if (pg == NULL) return false;
+
+  pg->dirty = 1;
+  return seg_remap(segment, offset, (uintptr_t)pg->metadata,
+                   calculate_prot(segment->prot), true);
+}
+
+static struct vm_seg *file_clone(struct vm_seg *segment, void *space) {
+  struct vm_seg *new_segment = kmalloc(sizeof(struct vm_seg));
+  *new_segment = *segment;
+  new_segment->space = space;
+  new_segment->amap = amap_create();
+  new_segment->resident = 0;
+  seg_account(new_segment, segment->resident, 0);
+  seg_hold_file(new_segment);
+  segment->forked = new_segment->forked = true;
+
+  // Both sides keep using the same cached pages, so just share the tables
+  hat_share_range(segment->space, space, segment->base, segment->len);
+
+  return new_segment;
+}
+
+static bool file_unmap(struct vm_seg *segment,
+                       uintptr_t unmap_base,
+                       size_t unmap_len) {
+  // Run some sanity checks on the unmap base/len
+  if (unmap_base + unmap_len > segment->base + segment->len) return false;
+  else if (unmap_base < segment->base || unmap_len > segment->len)
+    return false;
+
+  seg_unmap_ptes(segment, unmap_base, unmap_len);
+  vm_cache_writeback(segment->context,
+                     segment->offset + (unmap_base - segment->base), unmap_len);
+  return true;
+}
+
+static bool file_advise(struct vm_seg *segment,
+                        uintptr_t base,
+                        size_t len,
+                        int advice) {
+  size_t start = base - segment->base;
+
+  switch (advice) {
+    case MADV_DONTNEED:
+      // The pages live on in the cache, so only the mappings are dropped
+      seg_unmap_ptes(segment, base, len);
+      return true;
+    case MADV_WILLNEED:
+      seg_populate(segment->space, segment, start, start + len, false);
+      return true;
+    default:
+      return false;
+  }
+}
+
+static struct vm_seg *file_create(vm_space_t *space,
+                                  uintptr_t hint,
+                                  uint64_t len,
+                                  int prot,
+                                  int mode,
+                                  struct vnode *node,
+                                  size_t offset) {
+  // Make sure the flags/file are valid
+  if (!(mode & MAP_PRIVATE) == !(mode & MAP_SHARED)) {
+    klog(
+        "vm/seg: either MAP_PRIVATE or MAP_SHARED is required for a file "
+        "mapping!");
+    set_errno(EINVAL);
+    return NULL;
+  } else if (!S_ISREG(node->st.st_mode)) {
+    set_errno(ENODEV);
+    return NULL;
+  } else if (offset % cur_config->page_size != 0) {
+    set_errno(EINVAL);
+    return NULL;
+  }
+
+  struct vm_seg *segment = seg_create(space, hint, len, prot, mode);
+  // Only the part of the mapping that the file actually covers is read from
+  // it, with the rest reading back as zeroes
+  size_t size = node->st.st_size;
+  segment->context = node;
+  segment->offset = offset;
+  segment->file_len = (offset < size) ? MIN((size_t)len, size - offset) : 0;
+  seg_hold_file(segment);
+
+  if (mode & MAP_PRIVATE) {
+    segment->ops.fault = anon_fault;
+    segment->ops.clone = anon_clone;
+    segment->ops.unmap = anon_unmap;
+    segment->ops.advise = anon_advise;
   } else {
-    if (vm_find_seg(hint, NULL) != NULL) {
-      klog("vm/seg: (WARN) hint 0x%lx tried to overwrite existing mapping!",
-           hint);
-      segment->base = alloc_mmap_base(space, len);
-    } else {
-      segment->base = hint;
-    }
+    segment->ops.fault = file_fault;
+    segment->ops.clone = file_clone;
+    segment->ops.unmap = file_unmap;
+    segment->ops.advise = file_advise;
   }
 
-  // Add segment to the current space's mappings
-  vec_push(&space->mappings, segment);
+  // Map in the entire file up front, if requested
+  if ((mode & MAP_NODEMAND) && !(mode & __MAP_EMBED_ONLY))
+    seg_populate(space, segment, 0, len, false);
+
   return segment;
 }
 
 //////////////////////////////////
 //      Segment functions
 //////////////////////////////////
+void vm_seg_init() {
+  zero_page = (uintptr_t)vm_phys_alloc(1, VM_ALLOC_ZERO);
+
+  // Grab the fault-around window, which is capped to a single leaf table
+  size_t pages = cmdline_get32("fault_around", fault_around);
+  size_t max_pages = cur_config->huge_page_size / cur_config->page_size;
+  if (pages == 0 || (pages & (pages - 1)) != 0 || pages > max_pages) {
+    klog("vm/seg: invalid fault-around window of %u pages, using %u", pages,
+         fault_around);
+  } else {
+    fault_around = pages;
+  }
+}
+
+void vm_seg_destroy(struct vm_seg *sg) {
+  sg->ops.unmap(sg, sg->base, sg->len);
+
+  // Unmapping the entire segment leaves behind an empty amap
+  amap_release(sg->amap);
+  seg_put_file(sg);
+  kfree(sg);
+}
+
 struct vm_seg *vm_find_seg(uintptr_t addr, size_t *offset) {
-  vm_space_t *spc = this_cpu->cur_spc;
+  vm_space_t *spc = this_cpu_read(cur_spc);
 
   for (int i = 0; i < spc->mappings.length; i++) {
     struct vm_seg *sg = spc->mappings.data[i];
-    if (sg->base <= addr && addr <= (sg->base + sg->len)) {
+    if (sg->base <= addr && addr < (sg->base + sg->len)) {
       if (offset) *offset = addr - sg->base;
 
       return sg;
@@ -238,6 +708,262 @@ struct vm_seg *vm_find_seg(uintptr_t addr, size_t *offset) {
   return NULL;
 }
 
+static void count_resident(uintptr_t virt,
+                           uintptr_t phys,
+                           size_t size,
+                           void *arg) {
+  (void)virt;
+  (void)phys;
+  *(size_t *)arg += size / cur_config->page_size;
+}
+
+// Splits off everything at and above 'offset' into a new segment, which
+// takes the pages it covers along with it
+static struct vm_seg *seg_split(vm_space_t *space,
+                                struct vm_seg *segment,
+                                size_t offset) {
+  struct vm_seg *tail = kmalloc(sizeof(struct vm_seg));
+  *tail = *segment;
+  tail->base += offset;
+  tail->len -= offset;
+  tail->offset += offset;
+  tail->file_len = (segment->file_len > offset) ? segment->file_len - offset : 0;
+  tail->amap = amap_create();
+  tail->needs_copy = false;
+  tail->resident = tail->anon = 0;
+  seg_hold_file(tail);
+
+  segment->len = offset;
+  segment->file_len = MIN(segment->file_len, offset);
+
+  // Moving pages modifies the pagelist, so it can't be shared anymore
+  struct hash_table *pagelist = anon_pagelist(segment, true);
+  for (size_t i = 0; i < (size_t)pagelist->capacity; i++) {
+    struct vm_page *pg = pagelist->data[i];
+    if (pg == NULL) continue;
+
+    size_t key = *(size_t *)pagelist->keys[i];
+    if (key < offset) continue;
+
+    size_t new_key = key - offset;
+    htab_insert(&tail->amap->pagelist, &new_key, sizeof(size_t), pg);
+    htab_delete(pagelist, &key, sizeof(size_t));
+    tail->anon++;
+  }
+
+  // The counters move along with the pages, leaving the space's totals alone
+  hat_query_range(space, tail->base, tail->len, count_resident,
+                  &tail->resident);
+  tail->resident = MIN(tail->resident, segment->resident);
+  segment->resident -= tail->resident;
+  segment->anon -= tail->anon;
+
+  vec_push(&space->mappings, tail);
+  return tail;
+}
+
+// Makes sure that no segment straddles 'addr'
+static void seg_split_at(vm_space_t *space, uintptr_t addr) {
+  size_t offset;
+  struct vm_seg *segment = vm_find_seg(addr, &offset);
+  if (segment != NULL && offset != 0) seg_split(space, segment, offset);
+}
+
+static bool seg_mergeable(struct vm_seg *a, struct vm_seg *b) {
+  int ignored = MAP_FIXED | MAP_NODEMAND;
+  if (a->base + a->len != b->base || a->prot != b->prot ||
+      (a->mode & ~ignored) != (b->mode & ~ignored) ||
+      a->ops.fault != b->ops.fault || a->hugepage != b->hugepage ||
+      a->context != b->context)
+    return false;
+
+  // File segments also have to be contiguous within the file
+  return (a->context == NULL ||
+          (a->offset + a->len == b->offset && a->file_len == a->len));
+}
+
+// Folds 'b' (which directly follows 'a') into 'a', and frees it
+static void seg_merge(vm_space_t *space, struct vm_seg *a, struct vm_seg *b) {
+  struct hash_table *dest = anon_pagelist(a, true);
+  struct hash_table *src = anon_pagelist(b, true);
+  for (size_t i = 0; i < (size_t)src->capacity; i++) {
+    struct vm_page *pg = src->data[i];
+    if (pg == NULL) continue;
+
+    size_t key = *(size_t *)src->keys[i] + a->len;
+    htab_insert(dest, &key, sizeof(size_t), pg);
+    htab_delete(src, src->keys[i], sizeof(size_t));
+  }
+
+  a->len += b->len;
+  a->file_len += b->file_len;
+  a->resident += b->resident;
+  a->anon += b->anon;
+  a->forked = (a->forked && b->forked);
+  amap_release(b->amap);
+  seg_put_file(b);
+  vec_remove(&space->mappings, b);
+  kfree(b);
+}
+
+// Merges every segment within [start, end) with its neighbours, where they
+// ended up identical
+static void seg_merge_range(vm_space_t *space, uintptr_t start, uintptr_t end) {
+  struct vm_seg *cur = vm_find_seg(start - 1, NULL);
+  if (cur == NULL) cur = vm_find_seg(start, NULL);
+
+  while (cur != NULL && cur->base + cur->len <= end) {
+    struct vm_seg *next = vm_find_seg(cur->base + cur->len, NULL);
+    if (next == NULL) break;
+
+    if (seg_mergeable(cur, next))
+      seg_merge(space, cur, next);
+    else
+      cur = next;
+  }
+}
+
+// Checks that there are no holes within [addr, end)
+static bool seg_range_mapped(uintptr_t addr, uintptr_t end) {
+  while (addr < end) {
+    struct vm_seg *segment = vm_find_seg(addr, NULL);
+    if (segment == NULL) return false;
+
+    addr = segment->base + segment->len;
+  }
+
+  return true;
+}
+
+static bool seg_protect(vm_space_t *space,
+                        uintptr_t addr,
+                        size_t len,
+                        int prot) {
+  uintptr_t end = addr + len;
+  if (!seg_range_mapped(addr, end)) {
+    set_errno(ENOMEM);
+    return false;
+  }
+
+  seg_split_at(space, addr);
+  seg_split_at(space, end);
+
+  for (uintptr_t cur = addr; cur < end;) {
+    struct vm_seg *segment = vm_find_seg(cur, NULL);
+    segment->prot = prot;
+    cur = segment->base + segment->len;
+
+    // Rewrite the PTEs in place, which only ever revokes write access (since
+    // pages might still be copy-on-write), leaving it to be faulted back in
+    if (prot == PROT_NONE)
+      seg_unmap_ptes(segment, segment->base, segment->len);
+    else
+      vm_protect_range(space, segment->base, segment->len,
+                       calculate_prot(prot));
+  }
+
+  seg_merge_range(space, addr, end);
+  return true;
+}
+
+static bool seg_advise(vm_space_t *space,
+                       uintptr_t addr,
+                       size_t len,
+                       int advice) {
+  uintptr_t end = addr + len;
+  if (!seg_range_mapped(addr, end)) {
+    set_errno(ENOMEM);
+    return false;
+  }
+
+  switch (advice) {
+    case MADV_NORMAL:
+      return true;
+
+    case MADV_HUGEPAGE:
+    case MADV_NOHUGEPAGE:
+      seg_split_at(space, addr);
+      seg_split_at(space, end);
+
+      for (uintptr_t cur = addr; cur < end;) {
+        struct vm_seg *segment = vm_find_seg(cur, NULL);
+        segment->hugepage = (advice == MADV_HUGEPAGE);
+        cur = segment->base + segment->len;
+      }
+
+      seg_merge_range(space, addr, end);
+      return true;
+
+    case MADV_WILLNEED:
+    case MADV_DONTNEED:
+      // These work on any part of a segment, so there's no need to split
+      for (uintptr_t cur = addr; cur < end;) {
+        struct vm_seg *segment = vm_find_seg(cur, NULL);
+        uintptr_t seg_end = MIN(segment->base + segment->len, end);
+
+        if (segment->prot != PROT_NONE &&
+            !segment->ops.advise(segment, cur, seg_end - cur, advice)) {
+          set_errno(EINVAL);
+          return false;
+        }
+
+        cur = seg_end;
+      }
+
+      return true;
+
+    default:
+      set_errno(EINVAL);
+      return false;
+  }
+}
+
+bool vm_seg_protect(uintptr_t addr, size_t len, int prot) {
+  vm_space_t *space = this_cpu_read(cur_spc);
+  bool irq = vm_space_lock(space);
+  bool result = seg_protect(space, addr, len, prot);
+  vm_space_unlock(space, irq);
+  return result;
+}
+
+bool vm_seg_advise(uintptr_t addr, size_t len, int advice) {
+  vm_space_t *space = this_cpu_read(cur_spc);
+  bool irq = vm_space_lock(space);
+  bool result = seg_advise(space, addr, len, advice);
+  vm_space_unlock(space, irq);
+  return result;
+}
+
+void vm_seg_embed(struct vm_seg *sg,
+                  void *space,
+                  uintptr_t base,
+                  uintptr_t phys) {
+  bool irq = vm_space_lock(space);
+  sg->base = base;
+  sg->space = space;
+  vec_push(&((vm_space_t *)space)->mappings, sg);
+
+  // Fill in the pagelist with the (physically contiguous) backing pages, if
+  // the segment isn't faulted in on demand
+  if (phys == 0) {
+    vm_space_unlock(space, irq);
+    return;
+  }
+
+  for (size_t i = 0; i < sg->len; i += cur_config->page_size) {
+    struct vm_page *pg = kmalloc(sizeof(struct vm_page));
+    pg->metadata = (void *)(phys + i);
+    pg->refcount = 1;
+    pg->present = 1;
+    htab_insert(&sg->amap->pagelist, &i, sizeof(size_t), pg);
+  }
+
+  vm_map_range(space, phys, base, sg->len, calculate_prot(sg->prot));
+  seg_account(sg, sg->len / cur_config->page_size,
+              sg->len / cur_config->page_size);
+  vm_space_unlock(space, irq);
+}
+
 struct vm_seg *vm_create_seg(int mode, ...) {
   va_list va;
   va_start(va, mode);
@@ -245,16 +971,23 @@ struct vm_seg *vm_create_seg(int mode, ...) {
   int prot = va_arg(va, int);
   uint64_t len = va_arg(va, uint64_t);
   uint64_t hint = 0;
-  vm_space_t *space = this_cpu->cur_spc;
+  vm_space_t *space = this_cpu_read(cur_spc);
   struct vm_seg *sg = NULL;
-
-  // Gather the remaining args
-  if (mode & MAP_FIXED) hint = va_arg(va, uint64_t);
+  bool irq = vm_space_lock(space);
 
   if (mode & MAP_ANON) {
+    if (mode & MAP_FIXED) hint = va_arg(va, uint64_t);
+
     sg = anon_create(space, hint, len, prot, mode);
+  } else {
+    struct vnode *node = va_arg(va, struct vnode *);
+    size_t offset = va_arg(va, size_t);
+    if (mode & MAP_FIXED) hint = va_arg(va, uint64_t);
+
+    sg = file_create(space, hint, len, prot, mode, node, offset);
   }
 
+  vm_space_unlock(space, irq);
   va_end(va);
   return sg;
 }
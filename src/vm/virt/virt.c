@@ -1,5 +1,6 @@
 #include <arch/asm.h>
 #include <arch/hat.h>
+#include <arch/smp.h>
 #include <lib/builtin.h>
 #include <lib/kcon.h>
 #include <lib/stivale2.h>
@@ -10,27 +11,11 @@
 
 vm_space_t kernel_space;
 
-//////////////////////////
-//   ASID Management
-//////////////////////////
-uint32_t *asid_bitmap = NULL;
-
-static uint32_t alloc_asid() {
-  for (uint32_t i = 0; i < cur_config->asid_max; i++) {
-    if (!BIT_TEST(asid_bitmap, i)) {
-      BIT_SET(asid_bitmap, i);
-      return i;
-    }
-  }
-
-  PANIC(NULL, "vm/virt: Out of ASIDs");
-  return 0;
-}
-static void free_asid(uint32_t asid) {
-  if (asid > cur_config->asid_max) return;
+// Source of unique space IDs, which are never reused (unlike PCIDs)
+static uint64_t next_ctx_id = 0;
 
-  BIT_CLEAR(asid_bitmap, asid);
-}
+// Flushing more pages than this drops the entire space instead
+#define INVL_MAX_PAGES 32
 
 //////////////////////////
 //    Range Functions
@@ -43,50 +28,41 @@ void vm_map_range(vm_space_t *space,
   struct vm_config *cfg = cur_config;
 
   // Perform necissary alignments
-  if ((virt % cfg->page_size) != 0) ALIGN_DOWN(virt, cfg->page_size);
-  if ((phys % cfg->page_size) != 0) ALIGN_DOWN(phys, cfg->page_size);
-  if ((len % cfg->page_size) != 0) ALIGN_UP(len, cfg->page_size);
-
-  // TODO: Use a huge mapping if we can
-  int mode =
-      (flags & VM_PAGE_HUGE) ? TRANSLATE_DEPTH_HUGE : TRANSLATE_DEPTH_NORM;
-  size_t inc_size =
-      (flags & VM_PAGE_HUGE) ? cfg->huge_page_size : cfg->page_size;
-
-  for (uintptr_t start_phys = phys, start_virt = virt;
-       start_virt < (virt + len);
-       start_virt += inc_size, start_phys += inc_size) {
-    uint64_t *pte = hat_translate_addr(space->root, start_virt, true, mode);
-    if (pte == NULL) return;  // OOM has occured!
-
-    *pte = hat_create_pte(flags, start_phys,
-                          (flags & VM_PAGE_HUGE) ? true : false);
-  }
+  if ((virt % cfg->page_size) != 0) virt = ALIGN_DOWN(virt, cfg->page_size);
+  if ((phys % cfg->page_size) != 0) phys = ALIGN_DOWN(phys, cfg->page_size);
+  if ((len % cfg->page_size) != 0) len = ALIGN_UP(len, cfg->page_size);
+
+  hat_map_range(space, phys, virt, len, flags);
 }
 
-void vm_unmap_range(vm_space_t *space, uintptr_t virt, size_t len) {
+size_t vm_unmap_range(vm_space_t *space, uintptr_t virt, size_t len) {
   struct vm_config *cfg = cur_config;
 
   // Perform necissary alignments
-  if ((virt % cfg->page_size) != 0) ALIGN_DOWN(virt, cfg->page_size);
-  if ((len % cfg->page_size) != 0) ALIGN_UP(len, cfg->page_size);
-
-  for (uintptr_t start = virt; start < (virt + len);) {
-    uint64_t *pte = hat_translate_addr(space->root, start, false, 0);
-    if (pte == NULL) {
-      start += cfg->page_size;
-#ifdef __x86_64__
-    } else if (*pte & (1 << 7)) {
-      *pte = 0;
-      start += cfg->huge_page_size;
-#endif
-    } else {
-      *pte = 0;
-      start += cfg->huge_page_size;
-    }
-  }
+  if ((virt % cfg->page_size) != 0) virt = ALIGN_DOWN(virt, cfg->page_size);
+  if ((len % cfg->page_size) != 0) len = ALIGN_UP(len, cfg->page_size);
+
+  uintptr_t freed = 0;
+  size_t unmapped = hat_unmap_range(space, virt, len, &freed);
+
+  // Update the TLB, and only then free the tables left empty, which other
+  // CPUs could still be walking until they've been shot down
+  vm_invl(space, virt, len);
+  hat_release_pts(freed);
+  return unmapped;
+}
+
+void vm_protect_range(vm_space_t *space,
+                      uintptr_t virt,
+                      size_t len,
+                      int flags) {
+  struct vm_config *cfg = cur_config;
+
+  // Perform necissary alignments
+  if ((virt % cfg->page_size) != 0) virt = ALIGN_DOWN(virt, cfg->page_size);
+  if ((len % cfg->page_size) != 0) len = ALIGN_UP(len, cfg->page_size);
 
-  // Update the TLB
+  hat_protect_range(space, virt, len, flags);
   vm_invl(space, virt, len);
 }
 
@@ -95,8 +71,16 @@ void vm_unmap_range(vm_space_t *space, uintptr_t virt, size_t len) {
 //////////////////////////
 vm_space_t *vm_space_create() {
   vm_space_t *trt = (vm_space_t *)kmalloc(sizeof(vm_space_t));
-  trt->asid = alloc_asid();
+  if (trt == NULL) return NULL;
+
   trt->root = (uint64_t)vm_phys_alloc(1, VM_ALLOC_ZERO);
+  if (trt->root == 0) {
+    kfree(trt);
+    return NULL;
+  }
+
+  trt->ctx_id = ATOMIC_INC(&next_ctx_id);
+  trt->active = true;
 
   // Copy over the higher half from the kernel space
   uint64_t *pml4 = (uint64_t *)(trt->root + VM_MEM_OFFSET);
@@ -107,66 +91,202 @@ vm_space_t *vm_space_create() {
   return trt;
 }
 
-void vm_space_destroy(vm_space_t *s) {
-  free_asid(s->asid);
-  hat_scrub_pde(s->root, cur_config->levels);
-  for (int i = 0; i < s->mappings.length; i++) {
-    struct vm_seg *sg = s->mappings.data[i];
-    sg->ops.unmap(sg, sg->base, sg->len);
+// Locks the space with interrupts disabled, since it's also taken by the
+// page fault handler. Holders might be waiting on this CPU to flush its TLB
+// (see hat_shootdown), so keep doing that while spinning.
+bool vm_space_lock(vm_space_t *space) {
+  bool irq = asm_check_intr();
+  asm_disable_intr();
+
+  while (trylock(&space->lock)) {
+    hat_sync_pending();
+    asm volatile("pause");
   }
 
+  return irq;
+}
+
+void vm_space_unlock(vm_space_t *space, bool irq) {
+  spinrelease(&space->lock);
+  if (irq) asm_enable_intr();
+}
+
+void vm_space_destroy(vm_space_t *s) {
+  // Kick off any CPUs that are still borrowing the space (see hat_sync_tlb)
+  ATOMIC_WRITE(&s->active, false);
+  vm_invl(s, (uintptr_t)-1, 0);
+
+  // Drop all segments before tearing down the page tables, so that shared
+  // pages only lose our reference
+  bool irq = vm_space_lock(s);
+  for (int i = 0; i < s->mappings.length; i++)
+    vm_seg_destroy(s->mappings.data[i]);
+
+  vec_deinit(&s->mappings);
+  vm_space_unlock(s, irq);
+  hat_scrub_pde(s);
   kfree(s);
 }
 
+// Resident and private pages are counted by the segments as they go, but
+// sharing changes behind a space's back (whenever the other side of a fork
+// copies or drops a page), so COW and PSS are worked out from the amaps here.
+// Cached and zero pages don't know who maps them, so PSS leaves them out.
+void vm_space_usage(vm_space_t *space, struct vm_usage *usage) {
+  usage->resident = ATOMIC_READ(&space->resident);
+  usage->anon = ATOMIC_READ(&space->anon);
+  usage->pt_pages = ATOMIC_READ(&space->pt_pages);
+  usage->cow = usage->pss = 0;
+
+  bool irq = vm_space_lock(space);
+  for (int i = 0; i < space->mappings.length; i++) {
+    struct vm_amap *amap = space->mappings.data[i]->amap;
+    uint32_t amap_refs = ATOMIC_READ(&amap->refcount);
+
+    for (int j = 0; j < amap->pagelist.capacity; j++) {
+      struct vm_page *pg = amap->pagelist.data[j];
+      if (pg == NULL) continue;
+
+      // Every other amap holding the page, and every other segment sharing
+      // this amap, maps it once more
+      size_t sharers = ATOMIC_READ(&pg->refcount) + amap_refs - 1;
+      if (sharers > 1) usage->cow++;
+
+      usage->pss += cur_config->page_size / sharers;
+    }
+  }
+  vm_space_unlock(space, irq);
+}
+
 void vm_space_fork(vm_space_t *old, vm_space_t *cur) {
+  // Nobody else can see the new space yet, so only the old one is locked
+  bool irq = vm_space_lock(old);
   for (int i = 0; i < old->mappings.length; i++) {
     struct vm_seg *sg = old->mappings.data[i];
-    sg->ops.clone(sg, cur);
+    struct vm_seg *new_sg = sg->ops.clone(sg, cur);
+
+    if (new_sg) vec_push(&cur->mappings, new_sg);
   }
+  vm_space_unlock(old, irq);
+
+  // The parent's mappings were write-protected behind its back, so flush
+  // them all in one go
+  cur->mmap_base = old->mmap_base;
+  vm_invl(old, (uintptr_t)-1, 0);
 }
 
 //////////////////////////
 //    Misc Functions
 //////////////////////////
 void vm_invl(vm_space_t *spc, uintptr_t addr, size_t len) {
-  if (addr == (uintptr_t)-1)
-    hat_invl(spc->root, 0, spc->asid, INVL_SINGLE_ASID);
+  // Bump the generation first, so that any CPU which has the space cached
+  // (but not loaded) flushes it the next time it switches over. Stay on this
+  // CPU until it has caught up, since that's the one the flush counts for.
+  bool irq = asm_check_intr();
+  asm_disable_intr();
+  uint64_t gen = ATOMIC_INC(&spc->tlb_gen);
 
-  for (uintptr_t index = addr; index < (addr + len);
-       index += cur_config->page_size) {
-    hat_invl(spc->root, index, spc->asid, INVL_SINGLE_ADDR);
+  // Large ranges are cheaper to drop all at once
+  if (addr == (uintptr_t)-1 ||
+      len > (INVL_MAX_PAGES * cur_config->page_size)) {
+    hat_invl(spc, 0,
+             (spc == &kernel_space) ? INVL_ENTIRE_TLB : INVL_SINGLE_ASID);
+  } else {
+    for (uintptr_t index = addr; index < (addr + len);
+         index += cur_config->page_size) {
+      hat_invl(spc, index, INVL_SINGLE_ADDR);
+    }
+
+    hat_invl_done(spc, gen);
   }
+
+  if (irq) asm_enable_intr();
+
+  // Then let the other CPUs that have the space loaded know
+  if (spc != &kernel_space) hat_shootdown(spc);
 }
 
 bool vm_fault(uintptr_t location, enum vm_fault flags) {
+  vm_space_t *space = this_cpu_read(cur_spc);
+  bool irq = vm_space_lock(space);
+
   uintptr_t offset;
   struct vm_seg *seg = vm_find_seg(location, &offset);
-  if (seg == NULL) return false;
+  bool handled = (seg != NULL && seg->ops.fault(seg, offset, flags));
+
+  vm_space_unlock(space, irq);
+  return handled;
+}
 
-  if (!seg->ops.fault(seg, offset, flags)) return false;
+void *vm_map_mmio(uintptr_t phys, size_t len, int cache) {
+  int flags = VM_PERM_READ | VM_PERM_WRITE | VM_PAGE_GLOBAL | cache;
+  uintptr_t base = ALIGN_DOWN(phys, cur_config->page_size);
+  len = ALIGN_UP(phys + len, cur_config->page_size) - base;
 
-  return true;
+  vm_map_range(&kernel_space, base, base + VM_MEM_OFFSET, len, flags);
+  vm_invl(&kernel_space, base + VM_MEM_OFFSET, len);
+  return (void *)(phys + VM_MEM_OFFSET);
 }
 
-void vm_virt_init() {
-  // First off, allocate the ASID bitmap (reserve ASID #0 for the kernel)
-  asid_bitmap = kmalloc(sizeof(uint32_t) * (cur_config->asid_max / 8));
-  BIT_SET(asid_bitmap, 0);
+// Attributes of the direct map for each type of memory map entry
+static int direct_map_flags(uint32_t type) {
+  int flags = VM_PERM_READ | VM_PERM_WRITE | VM_PAGE_GLOBAL | VM_PAGE_HUGE;
+
+  switch (type) {
+    case STIVALE2_MMAP_BAD_MEMORY:
+      return 0;
+    case STIVALE2_MMAP_RESERVED:
+      return flags | VM_CACHE_UNCACHED;
+    case STIVALE2_MMAP_FRAMEBUFFER:
+      return flags | VM_CACHE_WRITE_COMBINING;
+    case STIVALE2_MMAP_BOOTLOADER_RECLAIMABLE:
+      // The stivale2 terminal runs bootloader code from here
+      return flags | VM_PERM_EXEC;
+    default:
+      return flags;
+  }
+}
 
+void vm_virt_init() {
   // Setup the kernel space
   kernel_space.root = (uintptr_t)vm_phys_alloc(1, VM_ALLOC_ZERO);
-  kernel_space.asid = 0;
   kernel_space.active = true;
+  uint64_t *root = (uint64_t *)(kernel_space.root + VM_MEM_OFFSET);
 
-  // Copy in the higher half (from the bootloader)
-  uint64_t *bootloader_cr3 = (uint64_t *)asm_read_cr3();
-  for (int i = 256; i < 512; i++) {
-    ((uint64_t *)kernel_space.root)[i] = bootloader_cr3[i];
+  // Keep the kernel image where the bootloader put it, and allocate the rest
+  // of the higher half up front, so that every space shares its tables
+  uint64_t *bootloader_root =
+      (uint64_t *)((asm_read_cr3() & ~0xFFFull) + VM_MEM_OFFSET);
+  root[511] = bootloader_root[511];
+  for (int i = 256; i < 511; i++)
+    root[i] = (uint64_t)vm_phys_alloc(1, VM_ALLOC_ZERO) | 0b11;
+
+  // Build the direct map of physical memory, starting with the BIOS area
+  // (which holds the RSDP, but isn't always in the memory map)
+  vm_map_range(&kernel_space, 0, VM_MEM_OFFSET, 0x100000,
+               direct_map_flags(STIVALE2_MMAP_RESERVED));
+
+  struct stivale2_struct_tag_memmap *mm_tag =
+      stivale2_find_tag(STIVALE2_STRUCT_TAG_MEMMAP_ID);
+  for (uint64_t i = 0; i < mm_tag->entries;) {
+    struct stivale2_mmap_entry *entry = &mm_tag->memmap[i++];
+    int flags = direct_map_flags(entry->type);
+    uintptr_t base = entry->base, end = entry->base + entry->length;
+
+    // Merge neighbouring entries with the same attributes, so that they can
+    // use larger pages
+    while (i < mm_tag->entries && mm_tag->memmap[i].base == end &&
+           direct_map_flags(mm_tag->memmap[i].type) == flags)
+      end += mm_tag->memmap[i++].length;
+
+    if (flags != 0)
+      vm_map_range(&kernel_space, base, base + VM_MEM_OFFSET, end - base,
+                   flags);
   }
 
   // Load in the kernel space
   vm_space_load(&kernel_space);
 
   // Scrub the TLB
-  hat_invl(kernel_space.root, 0, 0, INVL_ENTIRE_TLB);
+  hat_invl(&kernel_space, 0, INVL_ENTIRE_TLB);
 }
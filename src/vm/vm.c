@@ -70,4 +70,5 @@ void vm_setup() {
 
   // Setup virtual memory...
   vm_virt_init();
+  vm_seg_init();
 }
@@ -21,7 +21,7 @@ file_dict = dict()
 
 def create_cmdline():
 	cmfile = open('build/gen/cmdline', 'w')
-	cmfile.write('maxsink=2,nopcid')
+	cmfile.write('maxsink=2')
 	cmfile.close()
 
 def add_dir(rel_path):